@@ -23,16 +23,24 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#if defined(NOCTT_PROFILE) || defined(NOCTT_TRACE)
+#include <time.h>
+#endif
 
 #include "noc_turtle.h"
 
 #define min(x, y) ((x) <= (y) ? (x) : (y))
 #define max(x, y) ((x) >= (y) ? (x) : (y))
 
+// Fraction of the program budget after which we start to kill the small
+// turtles.
+#define BUDGET_SOFT_LIMIT 0.5f
+
 
 // Some matrix functions.
 
@@ -116,19 +124,327 @@ static noctt_vec3_t mat_mul_vec(const float m[16], const noctt_vec3_t v)
 
 static void noctt_dead(noctt_turtle_t *turtle) { }
 
+// Scheduling events recorded with NOCTT_TRACE.
+enum {
+    TRACE_ITER_BEGIN,   // arg: iteration, or -1 for noctt_prog_run.
+    TRACE_ITER_END,
+    TRACE_RESUME_BEGIN,
+    TRACE_RESUME_END,
+    TRACE_CLONE,        // arg: new turtle.
+    TRACE_KILL,
+    TRACE_WAIT,         // arg: waited turtle, or -1 for JOIN.
+    TRACE_SLEEP,        // arg: number of iterations.
+    TRACE_WAKE,
+    TRACE_PRIM,         // arg: number of vertices.
+};
+
+#ifdef NOCTT_TRACE
+
+typedef struct {
+    long long           time;   // In ns since the start of the trace.
+    int                 type;
+    int                 turtle; // -1 for the scheduler.
+    int                 arg;
+    noctt_rule_func_t   func;
+} trace_event_t;
+
+// Ring buffer of the last events.
+struct noctt_trace {
+    trace_event_t   *events;
+    int             size;
+    long long       nb;         // Total number of events recorded.
+    struct timespec start;
+    int             current;    // Turtle being run, or -1.
+};
+
+static void trace_add(noctt_prog_t *prog, int type, int turtle, int arg)
+{
+    struct noctt_trace *trace = prog->trace;
+    trace_event_t *e;
+    struct timespec t;
+    if (!trace) return;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    e = &trace->events[trace->nb++ % trace->size];
+    e->time = (t.tv_sec - trace->start.tv_sec) * 1000000000LL +
+              (t.tv_nsec - trace->start.tv_nsec);
+    e->type = type;
+    e->turtle = turtle;
+    e->arg = arg;
+    e->func = turtle >= 0 ? prog->turtles[turtle].func : NULL;
+}
+
+#define TRACE(prog, type, turtle, arg) trace_add(prog, type, turtle, arg)
+#else
+#define TRACE(prog, type, turtle, arg)
+#endif
+
 noctt_vec3_t noctt_get_pos(const noctt_turtle_t *turtle)
 {
     noctt_vec3_t p = {0, 0, 0};
     return mat_mul_vec(turtle->mat, p);
 }
 
+// The runnable bitmap has one bit per slot of the pool, set for all the
+// turtles alive but the ones sleeping in the timer wheel or waiting in a
+// JOIN.  After it comes a second level with one bit per non zero word of
+// the first one, so that a sweep on a mostly sleeping pool only costs the
+// turtles awake.  A bit can be set for a slot that doesn't need to run
+// anymore: the sweep clears it when it visits the slot.
+#define RUNNABLE_WORDS(nb) (((nb) + 63) / 64)
+
+static int ctz(unsigned long long x)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static void runnable_set(noctt_prog_t *prog, int idx)
+{
+    unsigned long long *summary = prog->runnable + RUNNABLE_WORDS(prog->nb);
+    prog->runnable[idx / 64] |= 1ULL << (idx % 64);
+    summary[idx / 4096] |= 1ULL << (idx / 64 % 64);
+}
+
+static void runnable_clear(noctt_prog_t *prog, int idx)
+{
+    unsigned long long *summary = prog->runnable + RUNNABLE_WORDS(prog->nb);
+    prog->runnable[idx / 64] &= ~(1ULL << (idx % 64));
+    if (!prog->runnable[idx / 64])
+        summary[idx / 4096] &= ~(1ULL << (idx / 64 % 64));
+}
+
+// Return the first runnable slot from idx, or -1.
+static int runnable_next(const noctt_prog_t *prog, int idx)
+{
+    const unsigned long long *summary =
+        prog->runnable + RUNNABLE_WORDS(prog->nb);
+    int w = idx / 64, nb_words = RUNNABLE_WORDS(prog->nb);
+    unsigned long long bits;
+
+    if (idx >= prog->nb) return -1;
+    bits = prog->runnable[w] & (~0ULL << (idx % 64));
+    if (bits) return w * 64 + ctz(bits);
+    // Look for the next non zero word in the summary.
+    w++;
+    if (w >= nb_words) return -1;
+    bits = summary[w / 64] & (~0ULL << (w % 64));
+    w = w / 64;
+    while (!bits) {
+        if (++w >= RUNNABLE_WORDS(nb_words)) return -1;
+        bits = summary[w];
+    }
+    w = w * 64 + ctz(bits);
+    return w * 64 + ctz(prog->runnable[w]);
+}
+
+// Called when a slot of the pool gets free, so that noctt_clone doesn't
+// have to scan all the used slots before it.
+static void free_slot(noctt_prog_t *prog, int idx)
+{
+    prog->free_slot = min(prog->free_slot, idx);
+}
+
+// Return the children counter of a turtle for a given call depth.  The
+// counters of the callers are saved in the frames.
+static int *children_count(noctt_turtle_t *turtle, int depth)
+{
+    int f = turtle->frame, d = turtle->depth - 1;
+    if (depth >= turtle->depth) return &turtle->children;
+    while (d > depth) {
+        f = turtle->prog->frames[f].prev;
+        d--;
+    }
+    return &turtle->prog->frames[f].children;
+}
+
+static void tree_add(noctt_turtle_t *turtle, int parent, int depth)
+{
+    noctt_turtle_t *turtles = turtle->prog->turtles;
+    int idx = turtle - turtles;
+    turtle->parent = parent;
+    turtle->parent_depth = depth;
+    turtle->prev_sibling = -1;
+    turtle->next_sibling = -1;
+    if (parent == -1) return;
+    turtle->next_sibling = turtles[parent].first_child;
+    if (turtle->next_sibling != -1)
+        turtles[turtle->next_sibling].prev_sibling = idx;
+    turtles[parent].first_child = idx;
+    (*children_count(&turtles[parent], depth))++;
+}
+
+static void tree_remove(noctt_turtle_t *turtle)
+{
+    noctt_turtle_t *turtles = turtle->prog->turtles;
+    if (turtle->parent == -1) return;
+    if (turtle->prev_sibling != -1)
+        turtles[turtle->prev_sibling].next_sibling = turtle->next_sibling;
+    else
+        turtles[turtle->parent].first_child = turtle->next_sibling;
+    if (turtle->next_sibling != -1)
+        turtles[turtle->next_sibling].prev_sibling = turtle->prev_sibling;
+    (*children_count(&turtles[turtle->parent], turtle->parent_depth))--;
+    turtle->parent = -1;
+}
+
+// Remove a dying turtle from the tree.  Its children go to its parent, and
+// if the parent was waiting in a JOIN and has no more children, we wake it
+// up.
+static void tree_release(noctt_turtle_t *turtle)
+{
+    noctt_prog_t *prog = turtle->prog;
+    noctt_turtle_t *child, *parent;
+    int parent_idx = turtle->parent, depth = turtle->parent_depth;
+
+    tree_remove(turtle);
+    while (turtle->first_child != -1) {
+        child = &prog->turtles[turtle->first_child];
+        tree_remove(child);
+        tree_add(child, parent_idx, depth);
+    }
+    if (parent_idx == -1) return;
+    parent = &prog->turtles[parent_idx];
+    if (parent->children == 0 && (parent->iflags & NOCTT_FLAG_JOINING)) {
+        TRACE(prog, TRACE_WAKE, parent_idx, 0);
+        parent->iflags &= ~(NOCTT_FLAG_JOINING | NOCTT_FLAG_DONE);
+        runnable_set(prog, parent_idx);
+        prog->resched = true;
+    }
+}
+
+static void state_save(const noctt_turtle_t *turtle, noctt_frame_t *frame)
+{
+    frame->func = turtle->func;
+    frame->step = turtle->step;
+    frame->resume = turtle->resume;
+    memcpy(frame->mat, turtle->mat, sizeof(frame->mat));
+    memcpy(frame->scale, turtle->scale, sizeof(frame->scale));
+    memcpy(frame->color, turtle->color, sizeof(frame->color));
+    frame->flags = turtle->flags;
+    frame->n = turtle->n;
+    frame->i = turtle->i;
+    frame->tmp = turtle->tmp;
+    memcpy(frame->vars, turtle->vars, sizeof(frame->vars));
+    frame->rand_next = turtle->rand_next;
+}
+
+static void state_restore(noctt_turtle_t *turtle, const noctt_frame_t *frame)
+{
+    turtle->func = frame->func;
+    turtle->step = frame->step;
+    turtle->resume = frame->resume;
+    memcpy(turtle->mat, frame->mat, sizeof(frame->mat));
+    memcpy(turtle->scale, frame->scale, sizeof(frame->scale));
+    memcpy(turtle->color, frame->color, sizeof(frame->color));
+    turtle->flags = frame->flags;
+    turtle->n = frame->n;
+    turtle->i = frame->i;
+    turtle->tmp = frame->tmp;
+    memcpy(turtle->vars, frame->vars, sizeof(frame->vars));
+    turtle->rand_next = frame->rand_next;
+}
+
+// Save the state of a turtle in a new frame.  Return false if there is no
+// frame left.
+static bool frame_push(noctt_turtle_t *turtle)
+{
+    noctt_prog_t *prog = turtle->prog;
+    noctt_frame_t *frame;
+    int f = prog->free_frame;
+    if (f == -1) return false;
+    frame = &prog->frames[f];
+    prog->free_frame = frame->prev;
+    frame->prev = turtle->frame;
+    state_save(turtle, frame);
+    frame->children = turtle->children;
+    turtle->children = 0;
+    turtle->frame = f;
+    turtle->depth++;
+    return true;
+}
+
+// Return from a call: restore the state saved in the top frame.  The
+// children created during the call now belong to the caller, so we also
+// move them to the caller depth, otherwise they would count as children of
+// the next call at the same depth.  They were all added to the head of the
+// children list after the call started, so we can stop once we have seen
+// as many as the call counted.
+static void frame_pop(noctt_turtle_t *turtle)
+{
+    noctt_prog_t *prog = turtle->prog;
+    int f = turtle->frame, c, n = turtle->children;
+    noctt_frame_t *frame = &prog->frames[f];
+    state_restore(turtle, frame);
+    turtle->children += frame->children;
+    turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED;
+    turtle->frame = frame->prev;
+    turtle->depth--;
+    frame->prev = prog->free_frame;
+    prog->free_frame = f;
+    for (c = turtle->first_child; n && c != -1;
+         c = prog->turtles[c].next_sibling) {
+        if (prog->turtles[c].parent_depth > turtle->depth) {
+            prog->turtles[c].parent_depth = turtle->depth;
+            n--;
+        }
+    }
+}
+
 void noctt_kill(noctt_turtle_t *turtle)
 {
+    if (turtle->frame != -1) {
+        frame_pop(turtle);
+        return;
+    }
+    if (turtle->func != noctt_dead) {
+        TRACE(turtle->prog, TRACE_KILL, turtle - turtle->prog->turtles, 0);
+        tree_release(turtle);
+    }
+    if (turtle->data && turtle->prog->release_data)
+        turtle->prog->release_data(turtle);
+    turtle->data = NULL;
     turtle->func = noctt_dead;
     turtle->iflags |= NOCTT_FLAG_DONE;
     turtle->iflags &= ~NOCTT_FLAG_WAITING;
 }
 
+// Called by the YIELD macro.  Return true if the rule has to return.
+// Turtles that wait more than one iteration are put in the timer wheel, and
+// taken out of the runnable bitmap until they wake up, so that a sleeping
+// turtle costs nothing to the sweeps.
+bool noctt_yield(noctt_turtle_t *turtle, int n)
+{
+    noctt_prog_t *prog = turtle->prog;
+    int slot;
+    if (n <= 0 || prog->run_stack) return false;
+    turtle->iflags |= NOCTT_FLAG_DONE;
+    if (n == 1) return true;
+    TRACE(prog, TRACE_SLEEP, turtle - prog->turtles, n);
+    turtle->iflags |= NOCTT_FLAG_SLEEPING;
+    turtle->wake = prog->iter + n;
+    slot = turtle->wake % NOCTT_WHEEL_SIZE;
+    turtle->next = prog->wheel[slot];
+    prog->wheel[slot] = turtle - prog->turtles;
+    return true;
+}
+
+// Called by the JOIN macro.  Return true if the rule has to return.
+bool noctt_join(noctt_turtle_t *turtle)
+{
+    if (turtle->children == 0) return false;
+    TRACE(turtle->prog, TRACE_WAIT, turtle - turtle->prog->turtles, -1);
+    turtle->iflags |= NOCTT_FLAG_JOINING | NOCTT_FLAG_DONE;
+    return true;
+}
+
 static int noctt_tr_iter_op(int *n_tot, const float **codes, int *nb)
 {
     const float *c;
@@ -149,32 +465,33 @@ static int noctt_tr_iter_op(int *n_tot, const float **codes, int *nb)
     return op;
 }
 
-static void scale(noctt_turtle_t *turtle, float x, float y, float z)
+static void scale(float mat[16], float s[2], float x, float y, float z)
 {
-    mat_scale(turtle->mat, x, y, z);
-    turtle->scale[0] *= x;
-    turtle->scale[1] *= y;
+    mat_scale(mat, x, y, z);
+    s[0] *= x;
+    s[1] *= y;
 }
 
-static void scale_normalize(noctt_turtle_t *turtle)
+static void scale_normalize(float mat[16], float s[2])
 {
     float x, y;
-    x = turtle->scale[0];
-    y = turtle->scale[1];
+    x = s[0];
+    y = s[1];
     if (y > x)
-        scale(turtle, 1, x / y, 1);
+        scale(mat, s, 1, x / y, 1);
     if (x > y)
-        scale(turtle, y / x, 1, 1);
+        scale(mat, s, y / x, 1, 1);
 }
 
-static void grow(noctt_turtle_t *turtle, float x, float y)
+static void grow(const noctt_prog_t *prog, float mat[16], float s[2],
+                 float x, float y)
 {
     float sx, sy, kx, ky;
-    sx = turtle->scale[0] / turtle->prog->pixel_size;
-    sy = turtle->scale[1] / turtle->prog->pixel_size;
+    sx = s[0] / prog->pixel_size;
+    sy = s[1] / prog->pixel_size;
     kx = (2 * x + sx) / sx;
     ky = (2 * y + sy) / sy;
-    scale(turtle, kx, ky, 1);
+    scale(mat, s, kx, ky, 1);
 }
 
 static float mix(float x, float y, float t)
@@ -211,7 +528,7 @@ static float mix_angle(float x, float y, float t)
     return ret;
 }
 
-static void flip(noctt_turtle_t *turtle, float a)
+static void flip(float mat[16], float a)
 {
     a = a / 180 * M_PI;
     float x = cos(a);
@@ -221,7 +538,7 @@ static void flip(noctt_turtle_t *turtle, float a)
         2 * x * y    , y * y - x * x, 0, 0,
         0            , 0            , 1, 0,
         0            , 0            , 0, 1};
-    mat_mult(turtle->mat, m);
+    mat_mult(mat, m);
 }
 
 static int set_flags(int x, int mask, bool value)
@@ -232,53 +549,57 @@ static int set_flags(int x, int mask, bool value)
         return x & ~mask;
 }
 
-void noctt_tr(noctt_turtle_t *tur, int n_tot, const float *codes)
+// Apply the operations to a transformation and color.  vars can be NULL,
+// in which case VAR has no effect.
+static void tr(const noctt_prog_t *prog, float mat[16], float s[2],
+               float color[4], unsigned int *flags, float *vars,
+               int n_tot, const float *codes)
 {
     int nb = 0, op, c, i;
     while ((op = noctt_tr_iter_op(&n_tot, &codes, &nb)) != NOCTT_OP_END) {
         switch (op) {
         case NOCTT_OP_S:
             assert(nb >= 1 && nb <= 3);
-            scale(tur, codes[0],
+            scale(mat, s, codes[0],
                   nb > 1 ? codes[1] : codes[0],
                   nb > 2 ? codes[2] : 1);
             break;
         case NOCTT_OP_SAXIS:
             assert(nb == 2);
             assert(codes[0] >= 0 && codes[0] <= 2);
-            scale(tur, codes[0] == 0 ? codes[1] : 1,
+            scale(mat, s, codes[0] == 0 ? codes[1] : 1,
                        codes[0] == 1 ? codes[1] : 1,
                        codes[0] == 2 ? codes[1] : 1);
             break;
         case NOCTT_OP_SN:
             assert(nb == 0);
-            scale_normalize(tur);
+            scale_normalize(mat, s);
             break;
         case NOCTT_OP_G:
             assert(nb >= 1 && nb <= 2);
-            grow(tur, codes[0], nb > 1 ? codes[1] : codes[0]);
+            grow(prog, mat, s, codes[0], nb > 1 ? codes[1] : codes[0]);
             break;
         case NOCTT_OP_X:
             assert(nb > 0 && nb <= 3);
-            mat_translate(tur->mat,
+            mat_translate(mat,
                           codes[0],
                           nb > 1 ? codes[1] : 0,
                           nb > 2 ? codes[2] : 0);
             break;
         case NOCTT_OP_R:
             assert(nb == 1);
-            mat_rotate(tur->mat, codes[0] / 180 * M_PI, 0, 0, 1);
+            mat_rotate(mat, codes[0] / 180 * M_PI, 0, 0, 1);
             break;
         case NOCTT_OP_FLIP:
             assert(nb == 1);
-            flip(tur, codes[0]);
+            flip(mat, codes[0]);
             break;
         case NOCTT_OP_HUE:
             assert(nb == 1 || nb == 2);
             if (nb == 1)
-                tur->color[0] = mod(tur->color[0] + codes[0], 360);
+                color[0] = mod(color[0] + codes[0], 360);
             else
-                tur->color[0] = mix_angle(tur->color[0], codes[1], codes[0]);
+                color[0] = mix_angle(color[0], codes[1], codes[0]);
             break;
         case NOCTT_OP_SAT:
         case NOCTT_OP_LIGHT:
@@ -286,35 +607,35 @@ void noctt_tr(noctt_turtle_t *tur, int n_tot, const float *codes)
             assert(nb > 0 && nb <= 2);
             c = op - NOCTT_OP_HUE;
             if (nb == 1)
-                tur->color[c] = move_value(tur->color[c], codes[0], 1);
+                color[c] = move_value(color[c], codes[0], 1);
             else
-                tur->color[c] = mix(tur->color[c], codes[1], codes[0]);
+                color[c] = mix(color[c], codes[1], codes[0]);
             break;
         case NOCTT_OP_HSL:
             assert(nb == 3 || nb == 4);
             if (nb == 3) {
-                tur->color[0] = mod(tur->color[0] + codes[0], 360);
-                tur->color[1] = move_value(tur->color[1], codes[1], 1);
-                tur->color[2] = move_value(tur->color[2], codes[2], 1);
+                color[0] = mod(color[0] + codes[0], 360);
+                color[1] = move_value(color[1], codes[1], 1);
+                color[2] = move_value(color[2], codes[2], 1);
             } else {
-                tur->color[0] = mix_angle(tur->color[0], codes[1], codes[0]);
-                tur->color[1] = mix(tur->color[1], codes[2], codes[0]);
-                tur->color[2] = mix(tur->color[2], codes[3], codes[0]);
+                color[0] = mix_angle(color[0], codes[1], codes[0]);
+                color[1] = mix(color[1], codes[2], codes[0]);
+                color[2] = mix(color[2], codes[3], codes[0]);
             }
             break;
         case NOCTT_OP_FLAG:
             assert(nb == 1 || (nb % 2) == 0);
             for (i = 0; i < nb; i += 2) {
-                tur->flags = set_flags(tur->flags, codes[i],
+                *flags = set_flags(*flags, codes[i],
                                    nb > 1 ? codes[i + 1] : 1);
             }
             break;
         case NOCTT_OP_VAR:
             assert(nb % 2 == 0);
+            if (!vars) break;
             for (i = 0; i < nb; i += 2) {
-                assert(codes[i] >= 0 &&
-                       codes[i] < (sizeof(tur->vars) / sizeof(tur->vars[0])));
-                tur->vars[(int)codes[i]] = codes[i + 1];
+                assert(codes[i] >= 0 && codes[i] < NOCTT_NB_VARS);
+                vars[(int)codes[i]] = codes[i + 1];
             }
             break;
         default:
@@ -323,45 +644,469 @@ void noctt_tr(noctt_turtle_t *tur, int n_tot, const float *codes)
     }
 }
 
-void noctt_clone(noctt_turtle_t *turtle, int mode, int n, const float *ops)
+void noctt_tr(noctt_turtle_t *tur, int n, const float *ops)
+{
+    tr(tur->prog, tur->mat, tur->scale, tur->color, &tur->flags, tur->vars,
+       n, ops);
+}
+
+// Compute the random seed of a new child turtle.  We always advance the
+// parent generator, even if the clone fails, so that the rest of the parent
+// rule does not depend on the pool usage.
+static unsigned long split_seed(noctt_turtle_t *turtle)
+{
+    unsigned long x;
+    noctt_rand(turtle);
+    x = turtle->rand_next;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = (x >> 16) ^ x;
+    return x;
+}
+
+// Return the scale under which new turtles and calls don't start.  Normally
+// this is prog->min_scale, but when we get close to the budget limits we
+// raise it so that the smallest branches stop first.
+static float kill_scale(const noctt_prog_t *prog)
+{
+    float p = 0;
+    if (prog->max_prims)
+        p = max(p, (float)prog->total_prims / prog->max_prims);
+    if (prog->max_turtles)
+        p = max(p, (float)prog->active / prog->max_turtles);
+    if (p <= BUDGET_SOFT_LIMIT) return prog->min_scale;
+    if (p >= 1) return FLT_MAX;
+    return prog->min_scale * (1 - BUDGET_SOFT_LIMIT) / (1 - p);
+}
+
+// Return true if a new clone or call of this scale should not start.
+static bool too_small_scale(noctt_prog_t *prog, const float scale[2])
+{
+    float s = min(fabs(scale[0]), fabs(scale[1]));
+    if (s <= prog->min_scale) return true;
+    if (prog->max_prims == 0 && prog->max_turtles == 0) return false;
+    if (s > kill_scale(prog)) return false;
+    prog->degraded = true;
+    return true;
+}
+
+// Return true if a running turtle got too small and has to be killed.  The
+// budgets don't apply here, they only prevent new branches from starting.
+static bool too_small(const noctt_turtle_t *turtle)
+{
+    return min(fabs(turtle->scale[0]), fabs(turtle->scale[1])) <=
+           turtle->prog->min_scale;
+}
+
+static int rule_cmp(const void *a, const void *b)
+{
+    size_t x = (size_t)((const noctt_rule_t*)a)->func;
+    size_t y = (size_t)((const noctt_rule_t*)b)->func;
+    return x < y ? -1 : x > y ? +1 : 0;
+}
+
+void noctt_prog_set_rules(noctt_prog_t *prog, const noctt_rule_t *rules,
+                          int nb)
+{
+    free(prog->rules);
+    prog->rules = (noctt_rule_t*)malloc(nb * sizeof(*rules));
+    memcpy(prog->rules, rules, nb * sizeof(*rules));
+    prog->nb_rules = nb;
+    qsort(prog->rules, nb, sizeof(*rules), rule_cmp);
+}
+
+const noctt_rule_t *noctt_prog_get_rule(const noctt_prog_t *prog,
+                                        noctt_rule_func_t func)
+{
+    noctt_rule_t key;
+    if (!prog->nb_rules) return NULL;
+    key.func = func;
+    return (const noctt_rule_t*)bsearch(&key, prog->rules, prog->nb_rules,
+                                        sizeof(key), rule_cmp);
+}
+
+#ifdef NOCTT_PROFILE
+
+// Profiling counters.  The stats of the rules are stored in an array, with
+// a hash table from the rule functions to their index.
+struct noctt_profile {
+    noctt_stats_t       stats;
+    int                 allocated;
+    int                 *table;     // Index + 1 of the rule stats, or 0.
+    int                 table_size;
+    noctt_rule_stats_t  *current;   // Stats of the rule being run.
+};
+
+static struct noctt_profile *profile_get(noctt_prog_t *prog)
+{
+    if (!prog->profile)
+        prog->profile = (struct noctt_profile*)calloc(1,
+                                                sizeof(*prog->profile));
+    return prog->profile;
+}
+
+static void profile_delete(struct noctt_profile *profile)
+{
+    if (!profile) return;
+    free(profile->stats.rules);
+    free(profile->table);
+    free(profile);
+}
+
+static int profile_hash(noctt_rule_func_t func, int size)
+{
+    size_t v = (size_t)func;
+    v ^= v >> 16;
+    v *= 0x9E3779B1U;
+    return (v ^ (v >> 16)) & (size - 1);
+}
+
+static noctt_rule_stats_t *profile_rule(noctt_prog_t *prog,
+                                        noctt_rule_func_t func)
+{
+    struct noctt_profile *p = profile_get(prog);
+    noctt_rule_stats_t *stats;
+    int i, j;
+
+    if (p->stats.nb_rules * 2 >= p->table_size) {
+        p->table_size = max(64, p->table_size * 2);
+        free(p->table);
+        p->table = (int*)calloc(p->table_size, sizeof(*p->table));
+        for (i = 0; i < p->stats.nb_rules; i++) {
+            j = profile_hash(p->stats.rules[i].func, p->table_size);
+            while (p->table[j]) j = (j + 1) & (p->table_size - 1);
+            p->table[j] = i + 1;
+        }
+    }
+    for (j = profile_hash(func, p->table_size); p->table[j];
+         j = (j + 1) & (p->table_size - 1)) {
+        if (p->stats.rules[p->table[j] - 1].func == func)
+            return &p->stats.rules[p->table[j] - 1];
+    }
+    if (p->stats.nb_rules >= p->allocated) {
+        p->allocated = max(16, p->allocated * 2);
+        p->stats.rules = (noctt_rule_stats_t*)realloc(p->stats.rules,
+                                p->allocated * sizeof(*p->stats.rules));
+    }
+    stats = &p->stats.rules[p->stats.nb_rules++];
+    memset(stats, 0, sizeof(*stats));
+    stats->func = func;
+    p->table[j] = p->stats.nb_rules;
+    return stats;
+}
+
+#endif
+
+const noctt_stats_t *noctt_prog_stats(const noctt_prog_t *prog)
+{
+#ifdef NOCTT_PROFILE
+    int i;
+    const noctt_rule_t *rule;
+    noctt_stats_t *stats;
+    if (!prog->profile) return NULL;
+    stats = &prog->profile->stats;
+    stats->max_active = prog->peak_active;
+    stats->clone_failures = prog->clone_failures;
+    for (i = 0; i < stats->nb_rules; i++) {
+        rule = noctt_prog_get_rule(prog, stats->rules[i].func);
+        stats->rules[i].name = rule ? rule->name : NULL;
+    }
+    return stats;
+#else
+    return NULL;
+#endif
+}
+
+static int rule_stats_cmp(const void *a, const void *b)
+{
+    const noctt_rule_stats_t *x = *(const noctt_rule_stats_t**)a;
+    const noctt_rule_stats_t *y = *(const noctt_rule_stats_t**)b;
+    return x->time > y->time ? -1 : x->time < y->time ? +1 : 0;
+}
+
+void noctt_prog_dump_stats(const noctt_prog_t *prog)
+{
+    int i;
+    const noctt_stats_t *stats = noctt_prog_stats(prog);
+    const noctt_rule_stats_t **rules, *r;
+    if (!stats) {
+        printf("No stats (compile noc_turtle.c with NOCTT_PROFILE)\n");
+        return;
+    }
+    // Slowest rules first.
+    rules = (const noctt_rule_stats_t**)malloc(
+                    stats->nb_rules * sizeof(*rules));
+    for (i = 0; i < stats->nb_rules; i++) rules[i] = &stats->rules[i];
+    qsort(rules, stats->nb_rules, sizeof(*rules), rule_stats_cmp);
+    printf("%-20s %8s %8s %8s %8s %8s %10s\n", "rule", "calls", "resumes",
+           "clones", "prims", "verts", "time (ms)");
+    for (i = 0; i < stats->nb_rules; i++) {
+        r = rules[i];
+        if (r->name)
+            printf("%-20s", r->name);
+        else
+            printf("%-20p", (void*)(size_t)r->func);
+        printf(" %8d %8d %8d %8d %8d %10.3f\n", r->calls, r->resumes,
+               r->clones, r->prims, r->verts, r->time * 1000);
+    }
+    printf("max active turtles: %d / %d\n", stats->max_active, prog->nb);
+    printf("clone failures: %d\n", prog->clone_failures);
+    free(rules);
+}
+
+void noctt_prog_trace(noctt_prog_t *prog, int size)
+{
+#ifdef NOCTT_TRACE
+    if (prog->trace) free(prog->trace->events);
+    free(prog->trace);
+    prog->trace = NULL;
+    if (size <= 0) return;
+    prog->trace = (struct noctt_trace*)calloc(1, sizeof(*prog->trace));
+    prog->trace->events = (trace_event_t*)malloc(size *
+                                            sizeof(*prog->trace->events));
+    prog->trace->size = size;
+    prog->trace->current = -1;
+    clock_gettime(CLOCK_MONOTONIC, &prog->trace->start);
+#endif
+}
+
+#ifdef NOCTT_TRACE
+static const char *trace_rule_name(const noctt_prog_t *prog,
+                                   noctt_rule_func_t func, char *buf)
+{
+    const noctt_rule_t *rule = noctt_prog_get_rule(prog, func);
+    if (rule && rule->name) return rule->name;
+    sprintf(buf, "%p", (void*)(size_t)func);
+    return buf;
+}
+#endif
+
+bool noctt_prog_trace_export(const noctt_prog_t *prog, const char *path)
+{
+#ifdef NOCTT_TRACE
+    // Names of the instant events, in the order of the enum.
+    static const char *NAMES[] = {"", "", "", "", "clone", "kill", "wait",
+                                  "sleep", "wake", "prim"};
+    const struct noctt_trace *trace = prog->trace;
+    const trace_event_t *e;
+    long long i;
+    int tid, *depth;
+    bool ok, *seen;
+    char buf[32];
+    FILE *out;
+
+    if (!trace) return false;
+    out = fopen(path, "w");
+    if (!out) return false;
+    // tid 0 is the scheduler, and the turtles use their index + 1.  We
+    // skip the end events whose begin events got overwritten in the ring.
+    depth = (int*)calloc(prog->nb + 1, sizeof(*depth));
+    seen = (bool*)calloc(prog->nb + 1, sizeof(*seen));
+    fprintf(out, "{\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                 "\"tid\":0,\"args\":{\"name\":\"scheduler\"}}");
+    for (i = max(0, trace->nb - trace->size); i < trace->nb; i++) {
+        e = &trace->events[i % trace->size];
+        tid = e->turtle + 1;
+        if (!seen[tid] && tid) {
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                    "\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"turtle %d\"}}",
+                    tid, e->turtle);
+            seen[tid] = true;
+        }
+        switch (e->type) {
+        case TRACE_ITER_BEGIN:
+        case TRACE_RESUME_BEGIN:
+            depth[tid]++;
+            fprintf(out, ",\n{\"name\":\"");
+            if (e->type == TRACE_RESUME_BEGIN)
+                fprintf(out, "%s", trace_rule_name(prog, e->func, buf));
+            else if (e->arg == -1)
+                fprintf(out, "run");
+            else
+                fprintf(out, "iter %d", e->arg);
+            fprintf(out, "\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                    e->time / 1000.0, tid);
+            break;
+        case TRACE_ITER_END:
+        case TRACE_RESUME_END:
+            if (!depth[tid]) break;
+            depth[tid]--;
+            fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+                    e->time / 1000.0, tid);
+            break;
+        default:
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                    "\"ts\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"arg\":%d}}",
+                    NAMES[e->type], e->time / 1000.0, tid, e->arg);
+            break;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    ok = !ferror(out);
+    ok = (fclose(out) == 0) && ok;
+    free(depth);
+    free(seen);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+// Return true if a turtle is about to start a rule whose bounds are
+// completely outside the cull rectangle.
+static bool culled(const noctt_turtle_t *turtle)
+{
+    const noctt_prog_t *prog = turtle->prog;
+    const noctt_rule_t *rule;
+    const float *rect = prog->cull_rect;
+    noctt_vec3_t p;
+    float r;
+
+    if (rect[2] <= 0 || rect[3] <= 0) return false;
+    if (turtle->step || turtle->resume) return false;
+    rule = noctt_prog_get_rule(prog, turtle->func);
+    if (!rule || rule->radius <= 0) return false;
+    p = noctt_get_pos(turtle);
+    r = rule->radius * max(fabs(turtle->scale[0]), fabs(turtle->scale[1]));
+    return p.x + r < rect[0] || p.x - r > rect[0] + rect[2] ||
+           p.y + r < rect[1] || p.y - r > rect[1] + rect[3];
+}
+
+noctt_turtle_t *noctt_clone(noctt_turtle_t *turtle, int mode,
+                            int n, const float *ops)
 {
     int i;
+    unsigned long seed;
+    noctt_prog_t *prog = turtle->prog;
     noctt_turtle_t *new_turtle = NULL;
     assert(!(turtle->iflags & NOCTT_FLAG_WAITING));
     turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED;
-    for (i = 0; i < turtle->prog->nb; i++) {
-        if (turtle->prog->turtles[i].func == NULL) {
-            new_turtle = &turtle->prog->turtles[i];
+    seed = split_seed(turtle);
+    for (i = prog->free_slot; i < prog->nb; i++) {
+        if (prog->turtles[i].func == NULL) {
+            prog->free_slot = i;
+            new_turtle = &prog->turtles[i];
             *new_turtle = *turtle;
             new_turtle->iflags |= NOCTT_FLAG_JUST_CLONED;
+            new_turtle->iflags &= ~NOCTT_FLAG_WAITED;
+            new_turtle->rand_next = seed;
+            new_turtle->data = NULL;
             noctt_tr(new_turtle, n, ops);
+            // Over budget, don't even start the new turtle.
+            if ((prog->max_prims || prog->max_turtles) &&
+                    too_small_scale(prog, new_turtle->scale)) {
+                new_turtle->func = NULL;
+                return NULL;
+            }
+            new_turtle->first_child = -1;
+            new_turtle->children = 0;
+            new_turtle->frame = -1;
+            new_turtle->depth = 0;
+            tree_add(new_turtle, turtle - prog->turtles, turtle->depth);
+            TRACE(prog, TRACE_CLONE, turtle - prog->turtles, i);
             if (mode == 1) {
+                TRACE(prog, TRACE_WAIT, turtle - prog->turtles, i);
                 turtle->iflags |= NOCTT_FLAG_WAITING;
                 turtle->wait = i;
+                new_turtle->iflags |= NOCTT_FLAG_WAITED;
             }
-            turtle->prog->active++;
-            break;
+            prog->active++;
+            prog->peak_active = max(prog->peak_active, prog->active);
+            prog->total_turtles++;
+            prog->free_slot = i + 1;
+            runnable_set(prog, i);
+            prog->resched = true;
+#ifdef NOCTT_PROFILE
+            if (profile_get(prog)->current) prog->profile->current->clones++;
+#endif
+            // In run mode the new turtle goes on top of the stack, so that
+            // it is executed before its parent.
+            if (prog->run_stack)
+                prog->run_stack[prog->run_size++] = i;
+            return new_turtle;
         }
     }
+    prog->free_slot = prog->nb;
+    prog->clone_failures++;
+    return NULL;
+}
+
+// Called by CALL and TRANSFORM.  Save the turtle state in a frame and
+// apply the operations, the caller then continues as if it was the new
+// clone.  If we are out of frames, clone the turtle instead, and return true
+// to tell the caller to return and wait for the clone.  Also return true if
+// the call is too small to run.
+bool noctt_call(noctt_turtle_t *turtle, int n, const float *ops)
+{
+    noctt_prog_t *prog = turtle->prog;
+    unsigned long seed;
+
+    turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED;
+    if (!frame_push(turtle)) {
+        noctt_clone(turtle, 1, n, ops);
+        return true;
+    }
+    // Use the same seed as a clone would.
+    seed = split_seed(turtle);
+    prog->frames[turtle->frame].rand_next = turtle->rand_next;
+    turtle->rand_next = seed;
+    noctt_tr(turtle, n, ops);
+    // Same as a clone that gets killed before it starts: the caller goes
+    // back to the scheduler and resumes after the call.
+    if (too_small_scale(prog, turtle->scale)) {
+        frame_pop(turtle);
+        return true;
+    }
+    turtle->iflags |= NOCTT_FLAG_JUST_CLONED;
+    return false;
+}
+
+// Allocate a program with its turtles, order, runnable and frames arrays.
+static noctt_prog_t *prog_alloc(int nb)
+{
+    noctt_prog_t *proc;
+    int nb_words = RUNNABLE_WORDS(nb) + RUNNABLE_WORDS(RUNNABLE_WORDS(nb));
+    proc = (noctt_prog_t*)
+                calloc(1, sizeof(*proc) + nb * sizeof(*proc->turtles) +
+                          nb * sizeof(*proc->order) +
+                          nb_words * sizeof(*proc->runnable) +
+                          nb * NOCTT_NB_FRAMES * sizeof(*proc->frames));
+    proc->nb = nb;
+    proc->order = (noctt_turtle_t**)&proc->turtles[nb];
+    proc->runnable = (unsigned long long*)&proc->order[nb];
+    proc->frames = (noctt_frame_t*)&proc->runnable[nb_words];
+    proc->nb_frames = nb * NOCTT_NB_FRAMES;
+    return proc;
 }
 
 noctt_prog_t *noctt_prog_create(noctt_rule_func_t rule, int nb, int seed,
                                 float *mat, float pixel_size)
 {
+    int i;
     noctt_prog_t *proc;
     noctt_turtle_t *tur;
-    proc = (noctt_prog_t*)
-                calloc(1, sizeof(*proc) + nb * sizeof(*proc->turtles));
-    proc->nb = nb;
-    proc->rand_next = seed;
+    proc = prog_alloc(nb);
+    for (i = 0; i < proc->nb_frames; i++)
+        proc->frames[i].prev = i + 1 < proc->nb_frames ? i + 1 : -1;
+    proc->free_frame = proc->nb_frames ? 0 : -1;
     assert(pixel_size);
     proc->pixel_size = pixel_size;
     // Init first turtle.
     proc->active = 1;
+    proc->peak_active = 1;
+    proc->total_turtles = 1;
+    for (i = 0; i < NOCTT_WHEEL_SIZE; i++)
+        proc->wheel[i] = -1;
     tur = &proc->turtles[0];
     tur->color[3] = 1;
     tur->func = rule;
+    runnable_set(proc, 0);
     tur->prog = proc;
+    tur->rand_next = seed;
+    tur->parent = -1;
+    tur->first_child = -1;
+    tur->frame = -1;
     mat_set_identity(tur->mat);
     if (mat)
         mat_mult(tur->mat, mat);
@@ -372,11 +1117,241 @@ noctt_prog_t *noctt_prog_create(noctt_rule_func_t rule, int nb, int seed,
     return proc;
 }
 
+static void memo_delete(struct noctt_memo *memo);
+static void tess_delete(struct noctt_tess *tess);
+
 void noctt_prog_delete(noctt_prog_t *proc)
 {
+    int i;
+    for (i = 0; i < proc->nb; i++) {
+        if (proc->turtles[i].data && proc->release_data)
+            proc->release_data(&proc->turtles[i]);
+    }
+    memo_delete(proc->memo);
+    tess_delete(proc->tess);
+#ifdef NOCTT_PROFILE
+    profile_delete(proc->profile);
+#endif
+    noctt_prog_trace(proc, 0);
+    noctt_batch_release(&proc->batch);
+    free(proc->rules);
     free(proc);
 }
 
+// Program snapshots.  We save the program, the turtles and the frames as
+// they are, followed by their rules, saved as indices in the rules table
+// given by the client, and their resume addresses, saved relative to the
+// rule function.  This way a snapshot can be loaded in another process
+// running the same binary.
+
+#define SNAPSHOT_MAGIC "NOCTTSN"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char    magic[8];
+    int     version;
+    int     prog_size, turtle_size, frame_size;   // Sanity checks.
+    int     nb, nb_frames;
+    int     batch_nb, batch_size;
+} snapshot_header_t;
+
+typedef struct {
+    int         rule;       // Index in the table, -1 if unused, -2 if dead.
+    bool        has_resume;
+    ptrdiff_t   resume;     // Offset of the resume address from the rule.
+} snapshot_ref_t;
+
+static bool ref_save(noctt_rule_func_t func, void *resume,
+                     const noctt_rule_t *rules, int nb_rules,
+                     snapshot_ref_t *ref)
+{
+    int i;
+    memset(ref, 0, sizeof(*ref));
+    ref->rule = -1;
+    if (func == noctt_dead) ref->rule = -2;
+    for (i = 0; func && func != noctt_dead && i < nb_rules; i++) {
+        if (rules[i].func == func) ref->rule = i;
+    }
+    if (func && ref->rule == -1) return false;
+    ref->has_resume = resume != NULL;
+    if (resume) ref->resume = (size_t)resume - (size_t)func;
+    return true;
+}
+
+static bool ref_load(const snapshot_ref_t *ref,
+                     const noctt_rule_t *rules, int nb_rules,
+                     noctt_rule_func_t *func, void **resume)
+{
+    if (ref->rule >= nb_rules || ref->rule < -2) return false;
+    *func = ref->rule == -1 ? NULL :
+            ref->rule == -2 ? noctt_dead : rules[ref->rule].func;
+    *resume = ref->has_resume ? (void*)((size_t)*func + ref->resume) : NULL;
+    return true;
+}
+
+int noctt_prog_save(const noctt_prog_t *prog, const noctt_rule_t *rules,
+                    int nb_rules, void *buf)
+{
+    snapshot_header_t header;
+    snapshot_ref_t *refs;
+    const noctt_turtle_t *tur;
+    bool *used, ok = true;
+    char *p = (char*)buf;
+    int i, f, size;
+
+    if (prog->run_stack) return -1;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.prog_size = sizeof(*prog);
+    header.turtle_size = sizeof(*prog->turtles);
+    header.frame_size = sizeof(*prog->frames);
+    header.nb = prog->nb;
+    header.nb_frames = prog->nb_frames;
+    header.batch_nb = prog->batch.nb;
+    header.batch_size = prog->batch.size;
+    size = sizeof(header) + sizeof(*prog) +
+           prog->nb * sizeof(*prog->turtles) +
+           prog->nb_frames * sizeof(*prog->frames) +
+           (prog->nb + prog->nb_frames) * sizeof(*refs) +
+           prog->batch.size;
+
+    // Only the frames used by an alive turtle point to valid rules.
+    refs = (snapshot_ref_t*)calloc(prog->nb + prog->nb_frames, sizeof(*refs));
+    used = (bool*)calloc(prog->nb_frames + 1, sizeof(*used));
+    for (i = 0; i < prog->nb && ok; i++) {
+        tur = &prog->turtles[i];
+        if (tur->data) ok = false;
+        ok = ok && ref_save(tur->func, tur->resume, rules, nb_rules, &refs[i]);
+        if (!tur->func || tur->func == noctt_dead) continue;
+        for (f = tur->frame; f != -1; f = prog->frames[f].prev)
+            used[f] = true;
+    }
+    for (i = 0; i < prog->nb_frames && ok; i++) {
+        if (!used[i]) {
+            ref_save(NULL, NULL, rules, nb_rules, &refs[prog->nb + i]);
+            continue;
+        }
+        ok = ref_save(prog->frames[i].func, prog->frames[i].resume,
+                      rules, nb_rules, &refs[prog->nb + i]);
+    }
+    if (ok && p) {
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        memcpy(p, prog, sizeof(*prog));
+        p += sizeof(*prog);
+        memcpy(p, prog->turtles, prog->nb * sizeof(*prog->turtles));
+        p += prog->nb * sizeof(*prog->turtles);
+        memcpy(p, prog->frames, prog->nb_frames * sizeof(*prog->frames));
+        p += prog->nb_frames * sizeof(*prog->frames);
+        memcpy(p, refs, (prog->nb + prog->nb_frames) * sizeof(*refs));
+        p += (prog->nb + prog->nb_frames) * sizeof(*refs);
+        if (prog->batch.size) memcpy(p, prog->batch.data, prog->batch.size);
+    }
+    free(used);
+    free(refs);
+    return ok ? size : -1;
+}
+
+noctt_prog_t *noctt_prog_load(const void *buf, int size,
+                              const noctt_rule_t *rules, int nb_rules)
+{
+    snapshot_header_t header;
+    const snapshot_ref_t *refs;
+    const char *p = (const char*)buf;
+    noctt_prog_t *prog;
+    noctt_turtle_t **order;
+    unsigned long long *runnable;
+    noctt_frame_t *frames;
+    noctt_turtle_t *tur;
+    bool ok = true;
+    int i;
+
+    if (size < (int)sizeof(header)) return NULL;
+    memcpy(&header, p, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            header.version != SNAPSHOT_VERSION ||
+            header.prog_size != sizeof(*prog) ||
+            header.turtle_size != sizeof(*prog->turtles) ||
+            header.frame_size != sizeof(*prog->frames) ||
+            header.nb <= 0 ||
+            header.nb_frames != header.nb * NOCTT_NB_FRAMES ||
+            header.batch_size < 0)
+        return NULL;
+    if (size != (int)(sizeof(header) + sizeof(*prog) +
+                      header.nb * sizeof(*prog->turtles) +
+                      header.nb_frames * sizeof(*prog->frames) +
+                      (header.nb + header.nb_frames) * sizeof(*refs) +
+                      header.batch_size))
+        return NULL;
+    p += sizeof(header);
+
+    prog = prog_alloc(header.nb);
+    order = prog->order;
+    runnable = prog->runnable;
+    frames = prog->frames;
+    memcpy(prog, p, sizeof(*prog));
+    p += sizeof(*prog);
+    // The arrays were allocated from the header values.
+    if (prog->nb != header.nb || prog->nb_frames != header.nb_frames) {
+        free(prog);
+        return NULL;
+    }
+    memcpy(prog->turtles, p, header.nb * sizeof(*prog->turtles));
+    p += header.nb * sizeof(*prog->turtles);
+    memcpy(frames, p, header.nb_frames * sizeof(*prog->frames));
+    p += header.nb_frames * sizeof(*prog->frames);
+    refs = (const snapshot_ref_t*)p;
+    p += (header.nb + header.nb_frames) * sizeof(*refs);
+
+    // Reset all the pointers, the callbacks are set again by the client.
+    prog->render_callback = NULL;
+    prog->render_callback_data = NULL;
+    prog->order = order;
+    prog->runnable = runnable;
+    prog->frames = frames;
+    prog->run_stack = NULL;
+    prog->release_data = NULL;
+    prog->coro_pool = NULL;
+    prog->memo = NULL;
+    prog->tess = NULL;
+    prog->profile = NULL;
+    prog->trace = NULL;
+    prog->rules = NULL;
+    prog->nb_rules = 0;
+    prog->splat_callback = NULL;
+    prog->batch_callback = NULL;
+    prog->index = NULL;
+    memset(&prog->batch, 0, sizeof(prog->batch));
+
+    for (i = 0; i < prog->nb; i++) {
+        tur = &prog->turtles[i];
+        tur->prog = prog;
+        tur->data = NULL;
+        ok = ok && ref_load(&refs[i], rules, nb_rules,
+                            &tur->func, &tur->resume);
+        if (tur->func && !(tur->iflags &
+                    (NOCTT_FLAG_SLEEPING | NOCTT_FLAG_JOINING)))
+            runnable_set(prog, i);
+    }
+    for (i = 0; i < prog->nb_frames; i++) {
+        ok = ok && ref_load(&refs[prog->nb + i], rules, nb_rules,
+                            &frames[i].func, &frames[i].resume);
+    }
+    if (!ok) {
+        noctt_prog_delete(prog);
+        return NULL;
+    }
+    if (header.batch_size) {
+        prog->batch.data = (char*)malloc(header.batch_size);
+        memcpy(prog->batch.data, p, header.batch_size);
+        prog->batch.nb = header.batch_nb;
+        prog->batch.size = prog->batch.allocated = header.batch_size;
+    }
+    if (nb_rules) noctt_prog_set_rules(prog, rules, nb_rules);
+    return prog;
+}
+
 static noctt_turtle_t *get_wait(const noctt_turtle_t *tur)
 {
     return (tur->iflags & NOCTT_FLAG_WAITING) ? &tur->prog->turtles[tur->wait]
@@ -395,62 +1370,335 @@ static void assert_can_remove(const noctt_turtle_t *turtle)
     }
 }
 
+
+// Wake up the turtle that waits for a dead turtle.
+static void wake_waiter(noctt_turtle_t *tur)
+{
+    int i;
+    noctt_turtle_t *other;
+    for (i = 0; i < tur->prog->nb; i++) {
+        other = &tur->prog->turtles[i];
+        if (other->func && get_wait(other) == tur) {
+            TRACE(tur->prog, TRACE_WAKE, i, 0);
+            other->iflags &= ~NOCTT_FLAG_WAITING;
+        }
+    }
+    tur->iflags &= ~NOCTT_FLAG_WAITED;
+}
+
+// Remove a dead turtle from the pool in run mode.  Since we don't do full
+// sweeps there, we have to wake up the turtle waiting for it ourself.  It is
+// almost always the one just bellow in the stack.
+static void run_release(noctt_prog_t *prog, int pos)
+{
+    int idx = prog->run_stack[pos];
+    noctt_turtle_t *tur = &prog->turtles[idx], *other;
+
+    if (tur->iflags & NOCTT_FLAG_WAITED) {
+        other = pos ? &prog->turtles[prog->run_stack[pos - 1]] : NULL;
+        if (other && get_wait(other) == tur) {
+            TRACE(prog, TRACE_WAKE, other - prog->turtles, 0);
+            other->iflags &= ~NOCTT_FLAG_WAITING;
+            tur->iflags &= ~NOCTT_FLAG_WAITED;
+        } else {
+            wake_waiter(tur);
+        }
+    }
+    assert_can_remove(tur);
+    tur->func = NULL;
+    prog->active--;
+    free_slot(prog, idx);
+    memmove(&prog->run_stack[pos], &prog->run_stack[pos + 1],
+            (prog->run_size - pos - 1) * sizeof(*prog->run_stack));
+    prog->run_size--;
+}
+
+// Resume the rule of a turtle.
+static void run_turtle(noctt_turtle_t *turtle)
+{
+#ifdef NOCTT_PROFILE
+    struct timespec t0, t1;
+    noctt_rule_stats_t *stats = profile_rule(turtle->prog, turtle->func);
+    stats->resumes++;
+    if (turtle->step == 0 && !turtle->resume) stats->calls++;
+    turtle->prog->profile->current = stats;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+#endif
+#ifdef NOCTT_TRACE
+    if (turtle->prog->trace)
+        turtle->prog->trace->current = turtle - turtle->prog->turtles;
+#endif
+    TRACE(turtle->prog, TRACE_RESUME_BEGIN,
+          turtle - turtle->prog->turtles, 0);
+    turtle->func(turtle);
+    TRACE(turtle->prog, TRACE_RESUME_END, turtle - turtle->prog->turtles, 0);
+#ifdef NOCTT_TRACE
+    if (turtle->prog->trace) turtle->prog->trace->current = -1;
+#endif
+#ifdef NOCTT_PROFILE
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats->time += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    turtle->prog->profile->current = NULL;
+#endif
+    assert(turtle->func);
+    turtle->time += 1;
+}
+
+// Return true if the rule of the turtle has been called.
 static bool iter_context(noctt_turtle_t *turtle)
 {
     if (turtle->func == noctt_dead) {
+        // Only if the iteration got interrupted before the waiting turtle
+        // could see that we are dead.
+        if (turtle->iflags & NOCTT_FLAG_WAITED)
+            wake_waiter(turtle);
         assert_can_remove(turtle);
         turtle->func = NULL;
         turtle->prog->active--;
+        free_slot(turtle->prog, turtle - turtle->prog->turtles);
     }
 
     if (!turtle->func)
         turtle->iflags |= NOCTT_FLAG_DONE;
 
     if (turtle->iflags & NOCTT_FLAG_DONE)
-        return true;
+        return false;
 
-    if (get_wait(turtle) && (get_wait(turtle)->func == noctt_dead))
+    if (get_wait(turtle) && (get_wait(turtle)->func == noctt_dead)) {
+        TRACE(turtle->prog, TRACE_WAKE, turtle - turtle->prog->turtles, 0);
+        get_wait(turtle)->iflags &= ~NOCTT_FLAG_WAITED;
         turtle->iflags &= ~NOCTT_FLAG_WAITING;
+    }
     if (get_wait(turtle)) {
         if (get_wait(turtle)->iflags & NOCTT_FLAG_DONE)
             turtle->iflags |= NOCTT_FLAG_DONE;
         return false;
     }
 
-    if (    fabs(turtle->scale[0]) <= turtle->prog->min_scale ||
-            fabs(turtle->scale[0]) <= turtle->prog->min_scale) {
+    if (too_small(turtle) || culled(turtle)) {
         noctt_kill(turtle);
-        return true;
+        return false;
     }
 
-    turtle->func(turtle);
-    assert(turtle->func);
-    turtle->time += 1;
+    run_turtle(turtle);
     return true;
 }
 
-void noctt_prog_iter(noctt_prog_t *proc)
+static float screen_size(const noctt_turtle_t *turtle)
 {
-    int i;
-    bool keep_going = true;
+    return max(fabs(turtle->scale[0]), fabs(turtle->scale[1]));
+}
 
-    for (i = 0; i < proc->nb; i++)
-        proc->turtles[i].iflags &= ~NOCTT_FLAG_DONE;
+static int scale_cmp(const void *a, const void *b)
+{
+    const noctt_turtle_t *t1 = *(const noctt_turtle_t**)a;
+    const noctt_turtle_t *t2 = *(const noctt_turtle_t**)b;
+    float s1 = screen_size(t1), s2 = screen_size(t2);
+    if (s1 != s2) return s1 > s2 ? -1 : +1;
+    return t1 < t2 ? -1 : t1 > t2 ? +1 : 0;
+}
+
+// Fill prog->order with the turtles still to run in this iteration, sorted
+// by decreasing size.  If they all fit in what is left of the budget, the
+// order doesn't matter, and we keep them in pool order.
+static int sort_by_scale(noctt_prog_t *proc, int steps)
+{
+    int i, n = 0;
+    for (i = runnable_next(proc, 0); i != -1; i = runnable_next(proc, i + 1)) {
+        if (proc->turtles[i].func &&
+                !(proc->turtles[i].iflags & NOCTT_FLAG_DONE))
+            proc->order[n++] = &proc->turtles[i];
+    }
+    if (!proc->iter_budget || n <= proc->iter_budget - steps) return n;
+    qsort(proc->order, n, sizeof(*proc->order), scale_cmp);
+    return n;
+}
+
+// Remove the turtles that have to wake up at this iteration from the
+// timer wheel.
+static void wake_sleepers(noctt_prog_t *proc)
+{
+    int *idx = &proc->wheel[proc->iter % NOCTT_WHEEL_SIZE];
+    noctt_turtle_t *tur;
+    while (*idx != -1) {
+        tur = &proc->turtles[*idx];
+        if (tur->wake <= proc->iter) {
+            TRACE(proc, TRACE_WAKE, *idx, 0);
+            tur->iflags &= ~(NOCTT_FLAG_SLEEPING | NOCTT_FLAG_DONE);
+            runnable_set(proc, *idx);
+            *idx = tur->next;
+        } else {
+            idx = &tur->next;
+        }
+    }
+}
+
+static void flush_batch(noctt_prog_t *prog);
+
+// Visit a slot of the sweep, and take it out of the runnable bitmap if it
+// is free, sleeping or in a JOIN.
+static bool visit(noctt_prog_t *proc, noctt_turtle_t *tur)
+{
+    bool ret = iter_context(tur);
+    if (!tur->func ||
+            (tur->iflags & (NOCTT_FLAG_SLEEPING | NOCTT_FLAG_JOINING)))
+        runnable_clear(proc, tur - proc->turtles);
+    return ret;
+}
+
+// Run all the turtles not done yet, until the end of the sweep or until
+// we reach the budget.  Return the number of turtles resumed.  We only go
+// through the runnable bitmap, so the sleeping turtles don't cost anything.
+static int sweep(noctt_prog_t *proc)
+{
+    int i, n = 0, steps = 0;
+    bool keep_going = true;
+    noctt_turtle_t *tur;
 
+    proc->sweeping = false;
     while (keep_going) {
         keep_going = false;
-        for (i = 0; i < proc->nb; i++) {
-            iter_context(&proc->turtles[i]);
-            if (!(proc->turtles[i].iflags & NOCTT_FLAG_DONE))
+        proc->resched = false;
+        // The turtles created during a pass are not in the sorted list, so
+        // we do an other pass as long as something is left to run.
+        if (proc->sched == NOCTT_SCHED_SCALE) {
+            n = sort_by_scale(proc, steps);
+            keep_going = n > 0;
+        }
+        // In slot order, the new turtles after the current slot are seen
+        // in the same pass.
+        for (i = 0; ; i++) {
+            if (proc->sched == NOCTT_SCHED_SCALE) {
+                if (i >= n) break;
+                tur = proc->order[i];
+            } else {
+                i = runnable_next(proc, i);
+                if (i == -1) break;
+                tur = &proc->turtles[i];
+            }
+            steps += visit(proc, tur);
+            if (!(tur->iflags & NOCTT_FLAG_DONE))
                 keep_going = true;
+            if (proc->iter_budget && steps >= proc->iter_budget) {
+                proc->sweeping = true;
+                return steps;
+            }
+        }
+        // A new or woken up turtle could be in a slot we already visited,
+        // and it has to run in the same iteration.
+        if (proc->resched)
+            keep_going = true;
+    }
+    return steps;
+}
+
+static void iter(noctt_prog_t *proc)
+{
+    int i;
+
+    proc->iter++;
+    wake_sleepers(proc);
+    // If the last iteration ran out of budget, the turtles that already
+    // ran still have their DONE flag, so we only run the others.  We start
+    // a new sweep only if nothing was left.
+    if (proc->sweeping && sweep(proc))
+        return;
+    for (i = runnable_next(proc, 0); i != -1; i = runnable_next(proc, i + 1))
+        proc->turtles[i].iflags &= ~NOCTT_FLAG_DONE;
+    sweep(proc);
+}
+
+void noctt_prog_iter(noctt_prog_t *proc)
+{
+    TRACE(proc, TRACE_ITER_BEGIN, -1, proc->iter + 1);
+    iter(proc);
+    flush_batch(proc);
+    TRACE(proc, TRACE_ITER_END, -1, 0);
+}
+
+void noctt_prog_run(noctt_prog_t *proc)
+{
+    int i, pos, idx;
+    noctt_turtle_t *tur, *wait, *other;
+
+    assert(!proc->run_stack);
+    TRACE(proc, TRACE_ITER_BEGIN, -1, -1);
+    proc->sweeping = false;
+    // Start by removing the dead turtles left by noctt_prog_iter, and
+    // waking up all the sleeping ones.
+    for (i = 0; i < NOCTT_WHEEL_SIZE; i++)
+        proc->wheel[i] = -1;
+    for (i = 0; i < proc->nb; i++) {
+        tur = &proc->turtles[i];
+        tur->iflags &= ~NOCTT_FLAG_SLEEPING;
+        if (get_wait(tur) && get_wait(tur)->func == noctt_dead)
+            tur->iflags &= ~NOCTT_FLAG_WAITING;
+    }
+    for (i = 0; i < proc->nb; i++) {
+        if (proc->turtles[i].func != noctt_dead) continue;
+        proc->turtles[i].func = NULL;
+        proc->active--;
+        free_slot(proc, i);
+    }
+
+    proc->run_stack = (int*)malloc(proc->nb * sizeof(*proc->run_stack));
+    proc->run_size = 0;
+    for (i = proc->nb - 1; i >= 0; i--) {
+        if (proc->turtles[i].func)
+            proc->run_stack[proc->run_size++] = i;
+    }
+
+    while (proc->run_size) {
+        idx = proc->run_stack[proc->run_size - 1];
+        tur = &proc->turtles[idx];
+        // Can only happen with the initial turtles: put the turtle we wait
+        // for on top of the stack.
+        wait = get_wait(tur);
+        if (wait) {
+            for (pos = proc->run_size - 2; pos >= 0; pos--) {
+                if (&proc->turtles[proc->run_stack[pos]] == wait) break;
+            }
+            assert(pos >= 0);
+            proc->run_stack[proc->run_size - 1] = proc->run_stack[pos];
+            proc->run_stack[pos] = idx;
+            continue;
+        }
+        // Same thing for a turtle in a JOIN: its children are bellow in the
+        // stack, so we swap it with the first turtle that can run.
+        if (tur->iflags & NOCTT_FLAG_JOINING) {
+            for (pos = proc->run_size - 2; pos >= 0; pos--) {
+                other = &proc->turtles[proc->run_stack[pos]];
+                if (!(other->iflags & NOCTT_FLAG_JOINING) && !get_wait(other))
+                    break;
+            }
+            assert(pos >= 0);
+            proc->run_stack[proc->run_size - 1] = proc->run_stack[pos];
+            proc->run_stack[pos] = idx;
+            continue;
+        }
+        if (too_small(tur) || culled(tur)) {
+            noctt_kill(tur);
+        } else {
+            run_turtle(tur);
+        }
+        if (tur->func == noctt_dead) {
+            for (pos = proc->run_size - 1; pos >= 0; pos--) {
+                if (proc->run_stack[pos] == idx) break;
+            }
+            run_release(proc, pos);
         }
     }
+
+    free(proc->run_stack);
+    proc->run_stack = NULL;
+    flush_batch(proc);
+    TRACE(proc, TRACE_ITER_END, -1, 0);
 }
 
 int noctt_rand(noctt_turtle_t *turtle)
 {
-    turtle->prog->rand_next = turtle->prog->rand_next * 1103515245 + 12345;
-    return((unsigned)(turtle->prog->rand_next/65536) % 32768);
+    turtle->rand_next = turtle->rand_next * 1103515245 + 12345;
+    return((unsigned)(turtle->rand_next/65536) % 32768);
 }
 
 float noctt_frand(noctt_turtle_t *turtle, float min, float max)
@@ -468,80 +1716,344 @@ float noctt_pm(noctt_turtle_t *turtle, float x, float a)
     return noctt_frand(turtle, x - a, x + a);
 }
 
-static void render(const noctt_turtle_t *turtle, int n, const noctt_vec3_t *poly,
+// Transformation and color used to render a primitive.  This is all we
+// need from the turtle, so we don't have to copy the whole thing to apply
+// the primitive local transformations.
+typedef struct {
+    noctt_prog_t    *prog;
+    float           mat[16];
+    float           scale[2];
+    float           color[4];
+    unsigned int    flags;
+} prim_t;
+
+static void prim_init(prim_t *prim, const noctt_turtle_t *turtle,
+                      int n, const float *ops)
+{
+    prim->prog = turtle->prog;
+    memcpy(prim->mat, turtle->mat, sizeof(prim->mat));
+    memcpy(prim->scale, turtle->scale, sizeof(prim->scale));
+    memcpy(prim->color, turtle->color, sizeof(prim->color));
+    prim->flags = turtle->flags;
+    if (n)
+        tr(prim->prog, prim->mat, prim->scale, prim->color, &prim->flags,
+           NULL, n, ops);
+}
+
+static int prim_size(int n)
+{
+    return sizeof(noctt_prim_t) + n * sizeof(noctt_vec3_t);
+}
+
+void noctt_batch_add(noctt_batch_t *batch, int n, const noctt_vec3_t *poly,
+                     const float color[4], unsigned int flags)
+{
+    noctt_prim_t *prim;
+    int size = prim_size(n);
+    if (batch->size + size > batch->allocated) {
+        batch->allocated = max(batch->allocated * 2, batch->size + size);
+        batch->data = (char*)realloc(batch->data, batch->allocated);
+    }
+    prim = (noctt_prim_t*)(batch->data + batch->size);
+    prim->n = n;
+    prim->flags = flags;
+    memcpy(prim->color, color, sizeof(prim->color));
+    memcpy(prim->poly, poly, n * sizeof(*poly));
+    batch->size += size;
+    batch->nb++;
+}
+
+const noctt_prim_t *noctt_batch_next(const noctt_batch_t *batch,
+                                     const noctt_prim_t *prim)
+{
+    const char *p;
+    if (!prim) return batch->nb ? (const noctt_prim_t*)batch->data : NULL;
+    p = (const char*)prim + prim_size(prim->n);
+    return p < batch->data + batch->size ? (const noctt_prim_t*)p : NULL;
+}
+
+void noctt_batch_clear(noctt_batch_t *batch)
+{
+    batch->nb = 0;
+    batch->size = 0;
+}
+
+void noctt_batch_release(noctt_batch_t *batch)
+{
+    free(batch->data);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Compute the x, y bounding box of a polygon, as (x0, y0, x1, y1).
+static void bbox(int n, const noctt_vec3_t *poly, float box[4])
+{
+    int i;
+    box[0] = box[2] = poly[0].x;
+    box[1] = box[3] = poly[0].y;
+    for (i = 1; i < n; i++) {
+        box[0] = min(box[0], poly[i].x);
+        box[1] = min(box[1], poly[i].y);
+        box[2] = max(box[2], poly[i].x);
+        box[3] = max(box[3], poly[i].y);
+    }
+}
+
+// Return true if the primitive is smaller than prog->min_prim_size pixels.
+// In that case we send it to the splat callback if there is one.
+static bool sub_pixel(noctt_prog_t *prog, int n, const noctt_vec3_t *poly,
+                      const float color[4], unsigned int flags)
+{
+    float b[4], size;
+    noctt_vec3_t center;
+    bbox(n, poly, b);
+    size = max(b[2] - b[0], b[3] - b[1]) / prog->pixel_size;
+    if (size >= prog->min_prim_size) return false;
+    if (prog->splat_callback) {
+        center.x = (b[0] + b[2]) / 2;
+        center.y = (b[1] + b[3]) / 2;
+        center.z = poly[0].z;
+        prog->splat_callback(&center, size, color, flags,
+                             prog->render_callback_data);
+    }
+    return true;
+}
+
+// Clip a polygon against one side of the clip rectangle (one pass of the
+// Sutherland-Hodgman algorithm).  Keep the points where
+// sign * (p[axis] - v) >= 0.  Return the number of points in out, that
+// should have space for n + 1 points.
+static int clip_side(const noctt_vec3_t *in, int n, noctt_vec3_t *out,
+                     int axis, float v, float sign)
+{
+    int i, ret = 0;
+    float d0, d1, t;
+    const noctt_vec3_t *a, *b;
+    for (i = 0; i < n; i++) {
+        a = &in[i];
+        b = &in[(i + 1) % n];
+        d0 = sign * ((axis ? a->y : a->x) - v);
+        d1 = sign * ((axis ? b->y : b->x) - v);
+        if (d0 >= 0) out[ret++] = *a;
+        if ((d0 >= 0) != (d1 >= 0)) {
+            t = d0 / (d0 - d1);
+            out[ret].x = a->x + (b->x - a->x) * t;
+            out[ret].y = a->y + (b->y - a->y) * t;
+            out[ret].z = a->z + (b->z - a->z) * t;
+            ret++;
+        }
+    }
+    return ret;
+}
+
+// Max number of points of the polygons we clip.
+#define CLIP_MAX_POINTS 256
+
+// Check if a polygon is convex, whatever its orientation.  The polygons
+// going back on one of their edges (like a star with no branch length)
+// are not.
+static bool convex(int n, const noctt_vec3_t *p)
+{
+    int i, sign = 0;
+    float c, d;
+    const noctt_vec3_t *a, *b, *o;
+    for (i = 0; i < n; i++) {
+        a = &p[i];
+        b = &p[(i + 1) % n];
+        o = &p[(i + 2) % n];
+        c = (b->x - a->x) * (o->y - b->y) - (b->y - a->y) * (o->x - b->x);
+        d = (b->x - a->x) * (o->x - b->x) + (b->y - a->y) * (o->y - b->y);
+        if (c == 0 && d < 0) return false;
+        if (c == 0) continue;
+        if (sign && (c > 0) != (sign > 0)) return false;
+        sign = c > 0 ? 1 : -1;
+    }
+    return true;
+}
+
+// Clip the polygon against prog->clip_rect.  Return the number of points
+// of the clipped polygon, 0 if it is completely outside.  *poly is set to
+// the clipped points, that are stored in buf if needed.
+// The clients render the polygons as triangle fans, and clipping a concave
+// polygon would give a different fan, so those (and the ones too big for
+// buf) are returned whole.
+static int clip(const noctt_prog_t *prog, int n, const noctt_vec3_t **poly,
+                noctt_vec3_t buf[2 * (CLIP_MAX_POINTS + 4)])
+{
+    const float *r = prog->clip_rect;
+    const noctt_vec3_t *p = *poly;
+    float b[4];
+    noctt_vec3_t *tmp = buf + CLIP_MAX_POINTS + 4;
+
+    bbox(n, p, b);
+    if (b[2] < r[0] || b[0] > r[0] + r[2] || b[3] < r[1] || b[1] > r[1] + r[3])
+        return 0;
+    if (b[0] >= r[0] && b[2] <= r[0] + r[2] &&
+            b[1] >= r[1] && b[3] <= r[1] + r[3])
+        return n;
+    if (n > CLIP_MAX_POINTS || !convex(n, p))
+        return n;
+
+    // Each side adds at most one point.
+    n = clip_side(p, n, tmp, 0, r[0], +1);
+    n = clip_side(tmp, n, buf, 0, r[0] + r[2], -1);
+    n = clip_side(buf, n, tmp, 1, r[1], +1);
+    n = clip_side(tmp, n, buf, 1, r[1] + r[3], -1);
+    *poly = buf;
+    return n < 3 ? 0 : n;
+}
+
+static void render(noctt_prog_t *prog, int n, const noctt_vec3_t *poly,
                    const float color[4], unsigned int flags)
 {
-    if (!turtle->prog->render_callback) {
+    noctt_vec3_t buf[2 * (CLIP_MAX_POINTS + 4)];
+    if (prog->min_prim_size > 0 && n > 0 &&
+            sub_pixel(prog, n, poly, color, flags))
+        return;
+    if (prog->clip_rect[2] > 0 && prog->clip_rect[3] > 0 && n > 0) {
+        n = clip(prog, n, &poly, buf);
+        if (n == 0) return;
+    }
+    if (prog->max_prims && prog->total_prims >= prog->max_prims) {
+        prog->degraded = true;
+        return;
+    }
+    prog->total_prims++;
+#ifdef NOCTT_TRACE
+    if (prog->trace && prog->trace->current != -1)
+        TRACE(prog, TRACE_PRIM, prog->trace->current, n);
+#endif
+#ifdef NOCTT_PROFILE
+    if (prog->profile && prog->profile->current) {
+        prog->profile->current->prims++;
+        prog->profile->current->verts += n;
+    }
+#endif
+    if (prog->index)
+        noctt_index_add(prog->index, n, poly, flags);
+    if (prog->batch_callback) {
+        noctt_batch_add(&prog->batch, n, poly, color, flags);
+        return;
+    }
+    if (!prog->render_callback) {
         printf("ERROR: need to set a render callback\n");
         assert(0);
     }
-    turtle->prog->render_callback(n, poly, color, flags,
-                               turtle->prog->render_callback_data);
+    prog->render_callback(n, poly, color, flags,
+                          prog->render_callback_data);
 }
 
-void noctt_poly(const noctt_turtle_t *turtle, int n, const noctt_vec3_t *poly)
+static void poly_(const prim_t *prim, int n, const noctt_vec3_t *poly)
 {
     noctt_vec3_t *points = (noctt_vec3_t*)malloc(n * sizeof(*points));
     int i;
     for (i = 0; i < n; i++)
-        points[i] = mat_mul_vec(turtle->mat, poly[i]);
-    render(turtle, n, points, turtle->color, turtle->flags);
+        points[i] = mat_mul_vec(prim->mat, poly[i]);
+    render(prim->prog, n, points, prim->color, prim->flags);
     free(points);
 }
 
-void noctt_square(const noctt_turtle_t *turtle)
+static void square_(const prim_t *prim)
 {
     noctt_vec3_t poly[4] = {
         {-0.5, -0.5}, {+0.5, -0.5}, {+0.5, +0.5}, {-0.5, +0.5}
     };
-    noctt_poly(turtle, 4, poly);
+    poly_(prim, 4, poly);
 }
 
-void noctt_rsquare(const noctt_turtle_t *turtle, float c)
+// Max number of segments of a tessellated circle.
+#define TESS_MAX_SEGMENTS 128
+
+// Points of the circles of diameter 1 for each number of segments, so that
+// we don't compute the cos and sin of every circle we render.  The cache
+// belongs to the program, since several programs can run in parallel
+// threads.
+struct noctt_tess {
+    noctt_vec3_t *circles[TESS_MAX_SEGMENTS + 1];
+};
+
+static void tess_delete(struct noctt_tess *tess)
+{
+    int i;
+    if (!tess) return;
+    for (i = 0; i <= TESS_MAX_SEGMENTS; i++)
+        free(tess->circles[i]);
+    free(tess);
+}
+
+// Return the n points of a circle of diameter 1 cut in n segments.
+static const noctt_vec3_t *unit_circle(noctt_prog_t *prog, int n)
+{
+    noctt_vec3_t *p;
+    int i;
+
+    if (!prog->tess)
+        prog->tess = (struct noctt_tess*)calloc(1, sizeof(*prog->tess));
+    if (!prog->tess->circles[n]) {
+        p = (noctt_vec3_t*)calloc(n, sizeof(*p));
+        for (i = 0; i < n; i++) {
+            p[i].x = 0.5f * cos(2 * M_PI * i / n);
+            p[i].y = 0.5f * sin(2 * M_PI * i / n);
+        }
+        prog->tess->circles[n] = p;
+    }
+    return prog->tess->circles[n];
+}
+
+// Number of segments needed to render an arc of a given radius (in render
+// space) and angle, so that the error stays under prog->tess_tolerance
+// pixels.  Return def if the tolerance is not set.
+static int tess_segments(const noctt_prog_t *prog, float r, float angle,
+                         int def)
 {
-    const int n = 8;
-    float sx, sy, sm, rx, ry, r, aa;
+    float e, n;
+    if (prog->tess_tolerance <= 0) return def;
+    r = fabs(r) / prog->pixel_size;
+    e = prog->tess_tolerance;
+    if (r <= e) return 1;
+    n = ceil(angle / (2 * acos(1 - e / r)));
+    return (int)min(n, TESS_MAX_SEGMENTS * angle / (2 * M_PI));
+}
+
+static void rsquare_(const prim_t *prim, float c)
+{
+    int n, m;
+    float sx, sy, sm, rx, ry, r;
     int a, i;
-    noctt_vec3_t *poly;
+    const noctt_vec3_t *circle;
+    noctt_vec3_t poly[TESS_MAX_SEGMENTS + 4];
 
-    c *= turtle->prog->pixel_size;
-    sx = turtle->scale[0];
-    sy = turtle->scale[1];
+    c *= prim->prog->pixel_size;
+    sx = prim->scale[0];
+    sy = prim->scale[1];
     sm = min(sx, sy);
     r = max((sm - c) / 2, 0);
+    // Each corner is a quarter of a circle cut in m segments.
+    n = tess_segments(prim->prog, r, M_PI / 2, 7) + 1;
+    m = 4 * (n - 1);
+    circle = unit_circle(prim->prog, m);
     rx = r / sx;
     ry = r / sy;
     const float d[][2] = {{+0.5f - rx, +0.5f - ry},
                           {-0.5f + rx, +0.5f - ry},
                           {-0.5f + rx, -0.5f + ry},
                           {+0.5f - rx, -0.5f + ry}};
-    poly = (noctt_vec3_t*)calloc(4 * n, sizeof(*poly));
     for (i = 0, a = 0; i < 4 * n; i++) {
-        aa = a * M_PI / (2 * (n - 1));
-        poly[i].x = rx * cos(aa) + d[i / n][0];
-        poly[i].y = ry * sin(aa) + d[i / n][1];
+        poly[i].x = 2 * rx * circle[a % m].x + d[i / n][0];
+        poly[i].y = 2 * ry * circle[a % m].y + d[i / n][1];
+        poly[i].z = 0;
         if ((i % n) != (n - 1)) a++;
     }
-    noctt_poly(turtle, 4 * n, poly);
-    free(poly);
+    poly_(prim, 4 * n, poly);
 }
 
-void noctt_circle(const noctt_turtle_t *turtle)
+static void circle_(const prim_t *prim)
 {
-    static const int CIRCLE_NB = 32;
-    static noctt_vec3_t *poly = NULL;
-    int i;
-    if (!poly) {
-        poly = (noctt_vec3_t*)calloc(CIRCLE_NB, sizeof(*poly));
-        for (i = 0; i < CIRCLE_NB; i++) {
-            poly[i].x = 0.5f * cos(2 * M_PI * i / CIRCLE_NB);
-            poly[i].y = 0.5f * sin(2 * M_PI * i / CIRCLE_NB);
-        }
-    }
-    noctt_poly(turtle, CIRCLE_NB, poly);
+    float r = max(fabs(prim->scale[0]), fabs(prim->scale[1])) / 2;
+    int n = max(tess_segments(prim->prog, r, 2 * M_PI, 32), 4);
+    poly_(prim, n, unit_circle(prim->prog, n));
 }
 
-void noctt_star(const noctt_turtle_t *turtle, int n, float t, float c)
+static void star_(const prim_t *prim, int n, float t, float c)
 {
     float a;
     int i;
@@ -566,6 +2078,1032 @@ void noctt_star(const noctt_turtle_t *turtle, int n, float t, float c)
                 mix(p[1 + 2 * i].y, p[1 + 2 * (i + 1)].y, c),
                 0, t);
     }
-    noctt_poly(turtle, 2 + n * 2, p);
+    poly_(prim, 2 + n * 2, p);
     free(p);
 }
+
+void noctt_poly_tr(const noctt_turtle_t *turtle, int n,
+                   const noctt_vec3_t *poly, int nops, const float *ops)
+{
+    prim_t prim;
+    prim_init(&prim, turtle, nops, ops);
+    poly_(&prim, n, poly);
+}
+
+void noctt_square_tr(const noctt_turtle_t *turtle, int nops, const float *ops)
+{
+    prim_t prim;
+    prim_init(&prim, turtle, nops, ops);
+    square_(&prim);
+}
+
+void noctt_rsquare_tr(const noctt_turtle_t *turtle, float c,
+                      int nops, const float *ops)
+{
+    prim_t prim;
+    prim_init(&prim, turtle, nops, ops);
+    rsquare_(&prim, c);
+}
+
+void noctt_circle_tr(const noctt_turtle_t *turtle, int nops, const float *ops)
+{
+    prim_t prim;
+    prim_init(&prim, turtle, nops, ops);
+    circle_(&prim);
+}
+
+void noctt_star_tr(const noctt_turtle_t *turtle, int n, float t, float c,
+                   int nops, const float *ops)
+{
+    prim_t prim;
+    prim_init(&prim, turtle, nops, ops);
+    star_(&prim, n, t, c);
+}
+
+void noctt_poly(const noctt_turtle_t *turtle, int n, const noctt_vec3_t *poly)
+{
+    noctt_poly_tr(turtle, n, poly, 0, NULL);
+}
+
+void noctt_square(const noctt_turtle_t *turtle)
+{
+    noctt_square_tr(turtle, 0, NULL);
+}
+
+void noctt_rsquare(const noctt_turtle_t *turtle, float c)
+{
+    noctt_rsquare_tr(turtle, c, 0, NULL);
+}
+
+void noctt_circle(const noctt_turtle_t *turtle)
+{
+    noctt_circle_tr(turtle, 0, NULL);
+}
+
+void noctt_star(const noctt_turtle_t *turtle, int n, float t, float c)
+{
+    noctt_star_tr(turtle, n, t, c, 0, NULL);
+}
+
+// If a primitive is an axis aligned rectangle, put its bounding box in
+// box and return true.
+static bool is_rect(const noctt_prim_t *prim, float eps, float box[4])
+{
+    int i;
+    const noctt_vec3_t *a, *b;
+    if (prim->n != 4) return false;
+    for (i = 0; i < 4; i++) {
+        a = &prim->poly[i];
+        b = &prim->poly[(i + 1) % 4];
+        if (a->z != prim->poly[0].z) return false;
+        if (fabs(a->x - b->x) > eps && fabs(a->y - b->y) > eps) return false;
+    }
+    bbox(4, prim->poly, box);
+    return box[2] - box[0] > eps && box[3] - box[1] > eps;
+}
+
+// Try to merge the rectangle b into the rectangle a.  They need to have the
+// same color and flags, and to share a full edge.
+static bool merge_rects(noctt_prim_t *a, const noctt_prim_t *b, float eps)
+{
+    float ba[4], bb[4], r[4];
+    bool ccw;
+    if (a->flags != b->flags ||
+            memcmp(a->color, b->color, sizeof(a->color)) != 0)
+        return false;
+    if (!is_rect(a, eps, ba) || !is_rect(b, eps, bb)) return false;
+    if (a->poly[0].z != b->poly[0].z) return false;
+    if (fabs(ba[1] - bb[1]) <= eps && fabs(ba[3] - bb[3]) <= eps &&
+            (fabs(ba[2] - bb[0]) <= eps || fabs(bb[2] - ba[0]) <= eps)) {
+        r[0] = min(ba[0], bb[0]); r[2] = max(ba[2], bb[2]);
+        r[1] = ba[1]; r[3] = ba[3];
+    } else if (fabs(ba[0] - bb[0]) <= eps && fabs(ba[2] - bb[2]) <= eps &&
+            (fabs(ba[3] - bb[1]) <= eps || fabs(bb[3] - ba[1]) <= eps)) {
+        r[1] = min(ba[1], bb[1]); r[3] = max(ba[3], bb[3]);
+        r[0] = ba[0]; r[2] = ba[2];
+    } else {
+        return false;
+    }
+    // Keep the winding of a.
+    ccw = (a->poly[1].x - a->poly[0].x) * (a->poly[2].y - a->poly[0].y) -
+          (a->poly[1].y - a->poly[0].y) * (a->poly[2].x - a->poly[0].x) >= 0;
+    a->poly[0].x = r[0]; a->poly[0].y = r[1];
+    a->poly[2].x = r[2]; a->poly[2].y = r[3];
+    a->poly[ccw ? 1 : 3].x = r[2]; a->poly[ccw ? 1 : 3].y = r[1];
+    a->poly[ccw ? 3 : 1].x = r[0]; a->poly[ccw ? 3 : 1].y = r[3];
+    return true;
+}
+
+// Merge the axis aligned rectangles of the batch that have the same color
+// and share an edge.  Inside a run of consecutive primitives with the same
+// color and flags the rendering order doesn't matter, so we sort the
+// rectangles of the run by row to merge them horizontally, then by column
+// to merge them vertically.  The merged rectangles keep the position of
+// the first one in the batch.
+
+typedef struct {
+    noctt_prim_t    *prim;
+    float           box[4];
+    bool            dead;   // Merged into an other one.
+} merge_item_t;
+
+static int merge_row_cmp(const void *a, const void *b)
+{
+    const merge_item_t *x = *(const merge_item_t**)a, *y = *(const merge_item_t**)b;
+    if (x->prim->poly[0].z != y->prim->poly[0].z)
+        return x->prim->poly[0].z < y->prim->poly[0].z ? -1 : +1;
+    if (x->box[1] != y->box[1]) return x->box[1] < y->box[1] ? -1 : +1;
+    if (x->box[3] != y->box[3]) return x->box[3] < y->box[3] ? -1 : +1;
+    if (x->box[0] != y->box[0]) return x->box[0] < y->box[0] ? -1 : +1;
+    return x < y ? -1 : x > y ? +1 : 0;
+}
+
+static int merge_col_cmp(const void *a, const void *b)
+{
+    const merge_item_t *x = *(const merge_item_t**)a, *y = *(const merge_item_t**)b;
+    if (x->prim->poly[0].z != y->prim->poly[0].z)
+        return x->prim->poly[0].z < y->prim->poly[0].z ? -1 : +1;
+    if (x->box[0] != y->box[0]) return x->box[0] < y->box[0] ? -1 : +1;
+    if (x->box[2] != y->box[2]) return x->box[2] < y->box[2] ? -1 : +1;
+    if (x->box[1] != y->box[1]) return x->box[1] < y->box[1] ? -1 : +1;
+    return x < y ? -1 : x > y ? +1 : 0;
+}
+
+// Sort the rectangles of a run and merge each one with the previous one if
+// we can.  Return the number of rectangles left in the list.
+static int merge_run(merge_item_t **run, int n, float eps,
+                     int (*cmp)(const void*, const void*))
+{
+    int i, nb = 0;
+    merge_item_t *a, *b;
+    qsort(run, n, sizeof(*run), cmp);
+    for (i = 0; i < n; i++) {
+        if (nb) {
+            // Merge into the one that comes first in the batch.
+            a = min(run[nb - 1], run[i]);
+            b = max(run[nb - 1], run[i]);
+            if (merge_rects(a->prim, b->prim, eps)) {
+                b->dead = true;
+                is_rect(a->prim, eps, a->box);
+                run[nb - 1] = a;
+                continue;
+            }
+        }
+        run[nb++] = run[i];
+    }
+    return nb;
+}
+
+static void merge_quads(noctt_prog_t *prog, noctt_batch_t *batch)
+{
+    merge_item_t *quads = (merge_item_t*)calloc(batch->nb, sizeof(*quads));
+    merge_item_t **run = (merge_item_t**)malloc(batch->nb * sizeof(*run));
+    int i, start, n, nb = 0, size = 0;
+    noctt_prim_t *prim = NULL;
+    float eps = prog->pixel_size * 0.01;
+
+    for (i = 0; i < batch->nb; i++) {
+        prim = (noctt_prim_t*)noctt_batch_next(batch, prim);
+        quads[i].prim = prim;
+    }
+    for (start = 0; start < batch->nb; start = i) {
+        n = 0;
+        for (i = start; i < batch->nb; i++) {
+            prim = quads[i].prim;
+            if (prim->flags != quads[start].prim->flags ||
+                    memcmp(prim->color, quads[start].prim->color,
+                           sizeof(prim->color)) != 0)
+                break;
+            if (is_rect(prim, eps, quads[i].box))
+                run[n++] = &quads[i];
+        }
+        if (n < 2) continue;
+        n = merge_run(run, n, eps, merge_row_cmp);
+        merge_run(run, n, eps, merge_col_cmp);
+    }
+    // The primitives only move toward the start of the data.
+    for (i = 0; i < batch->nb; i++) {
+        if (quads[i].dead) continue;
+        n = prim_size(quads[i].prim->n);
+        memmove(batch->data + size, quads[i].prim, n);
+        size += n;
+        nb++;
+    }
+    batch->nb = nb;
+    batch->size = size;
+    free(run);
+    free(quads);
+}
+
+// Occlusion culling of the batch.  We go through the primitives from front
+// to back (higher z first, then the last rendered first), and we keep a
+// coarse grid of the cells already fully covered by an opaque primitive,
+// with the depth of that primitive.  A primitive whose bounding box only
+// touches cells covered by something in front of it is hidden.  The cells
+// are grouped in tiles that store the min depth of their cells, so that we
+// can skip the cells of the big covered areas.
+
+#define OCC_MAX_TILES 16  // Max number of tiles per side.
+#define OCC_TILE 8        // Number of cells per tile side.
+
+typedef struct {
+    int     size;       // Number of cells per side.
+    float   box[4];     // (x0, y0, x1, y1) area covered by the grid.
+    float   cell[2];    // Size of a cell.
+    float   *depth;     // -INFINITY if not covered.
+    float   *tiles;
+} occ_grid_t;
+
+typedef struct {
+    noctt_prim_t    *prim;
+    int             index;  // Rendering order.
+    float           z;      // Max z of the primitive.
+} occ_item_t;
+
+static int occ_item_cmp(const void *a, const void *b)
+{
+    const occ_item_t *x = (const occ_item_t*)a, *y = (const occ_item_t*)b;
+    if (x->z != y->z) return x->z > y->z ? -1 : +1;
+    return y->index - x->index;
+}
+
+// Return true if the primitive can hide the ones behind it: it has to be
+// opaque, flat and convex.  Set ccw to the winding of the polygon.
+static bool occluder(const noctt_prog_t *prog, const noctt_prim_t *prim,
+                     bool *ccw)
+{
+    int i, sign = 0;
+    const noctt_vec3_t *a, *b, *c;
+    float cross;
+    if (prim->n < 3 || prim->color[3] < 1) return false;
+    if (prim->flags & prog->transparent_flags) return false;
+    for (i = 0; i < prim->n; i++) {
+        a = &prim->poly[i];
+        b = &prim->poly[(i + 1) % prim->n];
+        c = &prim->poly[(i + 2) % prim->n];
+        if (a->z != prim->poly[0].z) return false;
+        cross = (b->x - a->x) * (c->y - b->y) - (b->y - a->y) * (c->x - b->x);
+        if (cross == 0) continue;
+        if (sign && (cross > 0) != (sign > 0)) return false;
+        sign = cross > 0 ? +1 : -1;
+    }
+    *ccw = sign > 0;
+    return sign != 0;
+}
+
+static bool poly_contains(const noctt_prim_t *prim, bool ccw, float x, float y)
+{
+    int i;
+    const noctt_vec3_t *a, *b;
+    float cross;
+    for (i = 0; i < prim->n; i++) {
+        a = &prim->poly[i];
+        b = &prim->poly[(i + 1) % prim->n];
+        cross = (b->x - a->x) * (y - a->y) - (b->y - a->y) * (x - a->x);
+        if (ccw ? cross < 0 : cross > 0) return false;
+    }
+    return true;
+}
+
+// Range of cells touched by a bounding box, as (x0, y0, x1, y1) with x1 and
+// y1 excluded.  If inner is set, only the cells fully inside the box.
+static void occ_cells(const occ_grid_t *grid, const float box[4], bool inner,
+                      int r[4])
+{
+    int i;
+    float v;
+    for (i = 0; i < 4; i++) {
+        v = (box[i] - grid->box[i % 2]) / grid->cell[i % 2];
+        if (inner) v = (i < 2) ? ceil(v) : floor(v);
+        else       v = (i < 2) ? floor(v) : ceil(v);
+        r[i] = max(0, min(grid->size, (int)v));
+    }
+}
+
+static bool occ_hidden(const occ_grid_t *grid, const float box[4], float z)
+{
+    int r[4], tx, ty, x, y;
+    occ_cells(grid, box, false, r);
+    for (ty = r[1] / OCC_TILE; ty * OCC_TILE < r[3]; ty++)
+    for (tx = r[0] / OCC_TILE; tx * OCC_TILE < r[2]; tx++) {
+        if (grid->tiles[ty * grid->size / OCC_TILE + tx] >= z) continue;
+        for (y = max(r[1], ty * OCC_TILE);
+             y < min(r[3], (ty + 1) * OCC_TILE); y++)
+        for (x = max(r[0], tx * OCC_TILE);
+             x < min(r[2], (tx + 1) * OCC_TILE); x++) {
+            if (grid->depth[y * grid->size + x] < z) return false;
+        }
+    }
+    return true;
+}
+
+static void occ_add(occ_grid_t *grid, const noctt_prim_t *prim, bool ccw,
+                    const float box[4])
+{
+    int r[4], x, y, tx, ty, i;
+    float x0, y0, x1, y1, *d, m;
+    const float z = prim->poly[0].z;
+    occ_cells(grid, box, true, r);
+    if (r[0] >= r[2] || r[1] >= r[3]) return;
+    for (y = r[1]; y < r[3]; y++)
+    for (x = r[0]; x < r[2]; x++) {
+        d = &grid->depth[y * grid->size + x];
+        if (*d >= z) continue;
+        x0 = grid->box[0] + x * grid->cell[0];
+        y0 = grid->box[1] + y * grid->cell[1];
+        x1 = x0 + grid->cell[0];
+        y1 = y0 + grid->cell[1];
+        if (poly_contains(prim, ccw, x0, y0) &&
+            poly_contains(prim, ccw, x1, y0) &&
+            poly_contains(prim, ccw, x0, y1) &&
+            poly_contains(prim, ccw, x1, y1))
+            *d = z;
+    }
+    for (ty = r[1] / OCC_TILE; ty * OCC_TILE < r[3]; ty++)
+    for (tx = r[0] / OCC_TILE; tx * OCC_TILE < r[2]; tx++) {
+        m = INFINITY;
+        for (i = 0; i < OCC_TILE * OCC_TILE; i++) {
+            y = ty * OCC_TILE + i / OCC_TILE;
+            x = tx * OCC_TILE + i % OCC_TILE;
+            m = min(m, grid->depth[y * grid->size + x]);
+        }
+        grid->tiles[ty * grid->size / OCC_TILE + tx] = m;
+    }
+}
+
+// Remove the primitives of the batch hidden by opaque primitives in front
+// of them, keeping the order of the others.
+static void occlusion_cull(noctt_prog_t *prog, noctt_batch_t *batch)
+{
+    occ_grid_t grid;
+    occ_item_t *items;
+    noctt_prim_t *prim;
+    const noctt_prim_t *next;
+    float box[4], b[4];
+    int i, j, size = 0, nb = 0, n;
+    bool ccw, *hidden;
+
+    if (batch->nb < 2) return;
+    items = (occ_item_t*)calloc(batch->nb, sizeof(*items));
+    prim = NULL;
+    for (i = 0; i < batch->nb; i++) {
+        prim = (noctt_prim_t*)noctt_batch_next(batch, prim);
+        items[i].prim = prim;
+        items[i].index = i;
+        items[i].z = -INFINITY;
+        for (j = 0; j < prim->n; j++)
+            items[i].z = max(items[i].z, prim->poly[j].z);
+        if (prim->n == 0) continue;
+        bbox(prim->n, prim->poly, b);
+        if (i == 0) memcpy(box, b, sizeof(box));
+        box[0] = min(box[0], b[0]);
+        box[1] = min(box[1], b[1]);
+        box[2] = max(box[2], b[2]);
+        box[3] = max(box[3], b[3]);
+    }
+    if (!(box[2] > box[0] && box[3] > box[1])) {
+        free(items);
+        return;
+    }
+
+    // Use a smaller grid for the small batches.
+    n = min(OCC_MAX_TILES, (int)ceil(sqrt(batch->nb)));
+    grid.size = n * OCC_TILE;
+    memcpy(grid.box, box, sizeof(box));
+    grid.cell[0] = (box[2] - box[0]) / grid.size;
+    grid.cell[1] = (box[3] - box[1]) / grid.size;
+    grid.depth = (float*)malloc(grid.size * grid.size * sizeof(float));
+    grid.tiles = (float*)malloc(n * n * sizeof(float));
+    for (i = 0; i < grid.size * grid.size; i++) grid.depth[i] = -INFINITY;
+    for (i = 0; i < n * n; i++) grid.tiles[i] = -INFINITY;
+
+    hidden = (bool*)calloc(batch->nb, sizeof(*hidden));
+    qsort(items, batch->nb, sizeof(*items), occ_item_cmp);
+    for (i = 0; i < batch->nb; i++) {
+        prim = items[i].prim;
+        if (prim->n == 0) continue;
+        bbox(prim->n, prim->poly, b);
+        if (!(prim->flags & prog->keep_flags) &&
+                occ_hidden(&grid, b, items[i].z)) {
+            hidden[items[i].index] = true;
+            continue;
+        }
+        if (occluder(prog, prim, &ccw))
+            occ_add(&grid, prim, ccw, b);
+    }
+    free(grid.depth);
+    free(grid.tiles);
+
+    free(items);
+
+    for (i = 0, prim = (noctt_prim_t*)noctt_batch_next(batch, NULL); prim;
+         i++, prim = (noctt_prim_t*)next) {
+        next = noctt_batch_next(batch, prim);
+        if (hidden[i]) continue;
+        n = prim_size(prim->n);
+        memmove(batch->data + size, prim, n);
+        size += n;
+        nb++;
+    }
+    batch->nb = nb;
+    batch->size = size;
+    free(hidden);
+}
+
+static void flush_batch(noctt_prog_t *prog)
+{
+    if (!prog->batch_callback) return;
+    if (prog->occlusion_cull)
+        occlusion_cull(prog, &prog->batch);
+    if (prog->merge_quads)
+        merge_quads(prog, &prog->batch);
+    prog->batch_callback(&prog->batch, prog->render_callback_data);
+    noctt_batch_clear(&prog->batch);
+}
+
+// Spatial index of the rendered primitives: a uniform grid where each cell
+// has the list of the primitives whose bounding box touches it.
+
+typedef struct {
+    int     nb, allocated;
+    int     *ids;
+} index_cell_t;
+
+typedef struct {
+    float           box[4];     // (x0, y0, x1, y1) bounding box.
+    unsigned int    flags;
+    int             ofs;        // Offset of the vertices in index->verts.
+    int             n;
+    int             stamp;      // To only test each primitive once.
+} index_prim_t;
+
+struct noctt_index {
+    float           rect[4];
+    float           cell_size;
+    int             w, h;       // Number of cells.
+    index_cell_t    *cells;
+    index_prim_t    *prims;
+    int             nb, allocated;
+    noctt_vec3_t    *verts;
+    int             nb_verts, allocated_verts;
+    int             stamp;
+    noctt_hit_t     *hits;      // Results of the current query.
+    int             nb_hits, allocated_hits;
+};
+
+noctt_index_t *noctt_index_create(const float rect[4], float cell_size)
+{
+    noctt_index_t *index = (noctt_index_t*)calloc(1, sizeof(*index));
+    memcpy(index->rect, rect, sizeof(index->rect));
+    index->cell_size = cell_size;
+    index->w = max(1, (int)ceil(rect[2] / cell_size));
+    index->h = max(1, (int)ceil(rect[3] / cell_size));
+    index->cells = (index_cell_t*)calloc(index->w * index->h,
+                                         sizeof(*index->cells));
+    return index;
+}
+
+void noctt_index_clear(noctt_index_t *index)
+{
+    int i;
+    for (i = 0; i < index->w * index->h; i++) index->cells[i].nb = 0;
+    index->nb = 0;
+    index->nb_verts = 0;
+}
+
+void noctt_index_delete(noctt_index_t *index)
+{
+    int i;
+    if (!index) return;
+    for (i = 0; i < index->w * index->h; i++) free(index->cells[i].ids);
+    free(index->cells);
+    free(index->prims);
+    free(index->verts);
+    free(index->hits);
+    free(index);
+}
+
+// Range of cells touched by a (x0, y0, x1, y1) box, as (x0, y0, x1, y1)
+// with x1 and y1 included.  Return false if the box is outside the grid.
+static bool index_cells(const noctt_index_t *index, const float box[4],
+                        int r[4])
+{
+    r[0] = floor((box[0] - index->rect[0]) / index->cell_size);
+    r[1] = floor((box[1] - index->rect[1]) / index->cell_size);
+    r[2] = floor((box[2] - index->rect[0]) / index->cell_size);
+    r[3] = floor((box[3] - index->rect[1]) / index->cell_size);
+    if (r[2] < 0 || r[3] < 0 || r[0] >= index->w || r[1] >= index->h)
+        return false;
+    r[0] = max(r[0], 0);
+    r[1] = max(r[1], 0);
+    r[2] = min(r[2], index->w - 1);
+    r[3] = min(r[3], index->h - 1);
+    return true;
+}
+
+static float poly_area(int n, const noctt_vec3_t *poly)
+{
+    int i;
+    float ret = 0;
+    for (i = 0; i < n; i++)
+        ret += poly[i].x * poly[(i + 1) % n].y -
+               poly[(i + 1) % n].x * poly[i].y;
+    return ret / 2;
+}
+
+int noctt_index_add(noctt_index_t *index, int n, const noctt_vec3_t *poly,
+                    unsigned int flags)
+{
+    index_prim_t *prim;
+    index_cell_t *cell;
+    int r[4], x, y;
+
+    if (index->nb >= index->allocated) {
+        index->allocated = max(64, index->allocated * 2);
+        index->prims = (index_prim_t*)realloc(index->prims,
+                            index->allocated * sizeof(*index->prims));
+    }
+    if (index->nb_verts + n > index->allocated_verts) {
+        index->allocated_verts = max(index->nb_verts + n,
+                                     index->allocated_verts * 2);
+        index->verts = (noctt_vec3_t*)realloc(index->verts,
+                            index->allocated_verts * sizeof(*index->verts));
+    }
+    prim = &index->prims[index->nb];
+    prim->flags = flags;
+    prim->ofs = index->nb_verts;
+    prim->n = n;
+    prim->stamp = 0;
+    memcpy(index->verts + index->nb_verts, poly, n * sizeof(*poly));
+    index->nb_verts += n;
+    // The primitives without area are not visible, so we don't index them.
+    if (n > 0 && poly_area(n, poly) != 0) {
+        bbox(n, poly, prim->box);
+        if (index_cells(index, prim->box, r)) {
+            for (y = r[1]; y <= r[3]; y++)
+            for (x = r[0]; x <= r[2]; x++) {
+                cell = &index->cells[y * index->w + x];
+                if (cell->nb >= cell->allocated) {
+                    cell->allocated = max(8, cell->allocated * 2);
+                    cell->ids = (int*)realloc(cell->ids,
+                                    cell->allocated * sizeof(*cell->ids));
+                }
+                cell->ids[cell->nb++] = index->nb;
+            }
+        }
+    }
+    return index->nb++;
+}
+
+const noctt_vec3_t *noctt_index_get(const noctt_index_t *index, int id,
+                                    int *n, unsigned int *flags)
+{
+    const index_prim_t *prim = &index->prims[id];
+    if (n) *n = prim->n;
+    if (flags) *flags = prim->flags;
+    return index->verts + prim->ofs;
+}
+
+static void index_hit(noctt_index_t *index, int id, float dist)
+{
+    noctt_hit_t *hit;
+    if (index->nb_hits >= index->allocated_hits) {
+        index->allocated_hits = max(16, index->allocated_hits * 2);
+        index->hits = (noctt_hit_t*)realloc(index->hits,
+                            index->allocated_hits * sizeof(*index->hits));
+    }
+    hit = &index->hits[index->nb_hits++];
+    hit->id = id;
+    hit->flags = index->prims[id].flags;
+    hit->dist = dist;
+}
+
+// Clip the part [t0, t1] of a ray to a (x, y, w, h) rectangle.
+static bool clip_ray(const float rect[4], float x, float y, float dx, float dy,
+                     float *t0, float *t1)
+{
+    int i;
+    float r;
+    const float p[4] = {-dx, dx, -dy, dy};
+    const float q[4] = {x - rect[0], rect[0] + rect[2] - x,
+                        y - rect[1], rect[1] + rect[3] - y};
+    for (i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) return false;
+            continue;
+        }
+        r = q[i] / p[i];
+        if (p[i] < 0) {
+            if (r > *t1) return false;
+            *t0 = max(*t0, r);
+        } else {
+            if (r < *t0) return false;
+            *t1 = min(*t1, r);
+        }
+    }
+    return true;
+}
+
+static int hit_id_cmp(const void *a, const void *b)
+{
+    return ((const noctt_hit_t*)b)->id - ((const noctt_hit_t*)a)->id;
+}
+
+static int hit_dist_cmp(const void *a, const void *b)
+{
+    const noctt_hit_t *x = (const noctt_hit_t*)a, *y = (const noctt_hit_t*)b;
+    if (x->dist != y->dist) return x->dist < y->dist ? -1 : +1;
+    return y->id - x->id;
+}
+
+// Sort the hits of the query and copy the first size ones.
+static int index_results(noctt_index_t *index, noctt_hit_t *hits, int size,
+                         int (*cmp)(const void*, const void*))
+{
+    int nb = min(size, index->nb_hits);
+    qsort(index->hits, index->nb_hits, sizeof(*index->hits), cmp);
+    memcpy(hits, index->hits, nb * sizeof(*hits));
+    return nb;
+}
+
+static void index_start_query(noctt_index_t *index)
+{
+    index->nb_hits = 0;
+    index->stamp++;
+}
+
+// Check if a point is inside a primitive, rendered as a triangle fan.
+static bool prim_contains(const noctt_index_t *index,
+                          const index_prim_t *prim, float x, float y)
+{
+    int i, j;
+    float c[3];
+    const noctt_vec3_t *v = index->verts + prim->ofs, *a, *b;
+    if (x < prim->box[0] || x > prim->box[2] ||
+        y < prim->box[1] || y > prim->box[3]) return false;
+    for (i = 1; i + 1 < prim->n; i++) {
+        for (j = 0; j < 3; j++) {
+            a = j == 0 ? &v[0] : &v[i + j - 1];
+            b = j == 2 ? &v[0] : &v[i + j];
+            c[j] = (b->x - a->x) * (y - a->y) - (b->y - a->y) * (x - a->x);
+        }
+        if (c[0] == 0 && c[1] == 0 && c[2] == 0) continue;
+        if ((c[0] >= 0 && c[1] >= 0 && c[2] >= 0) ||
+            (c[0] <= 0 && c[1] <= 0 && c[2] <= 0)) return true;
+    }
+    return false;
+}
+
+int noctt_index_point(noctt_index_t *index, float x, float y,
+                      noctt_hit_t *hits, int size)
+{
+    int r[4], i, id;
+    float box[4] = {x, y, x, y};
+    const index_cell_t *cell;
+    index_start_query(index);
+    if (!index_cells(index, box, r)) return 0;
+    cell = &index->cells[r[1] * index->w + r[0]];
+    for (i = 0; i < cell->nb; i++) {
+        id = cell->ids[i];
+        if (prim_contains(index, &index->prims[id], x, y))
+            index_hit(index, id, 0);
+    }
+    return index_results(index, hits, size, hit_id_cmp);
+}
+
+int noctt_index_rect(noctt_index_t *index, const float rect[4],
+                     noctt_hit_t *hits, int size)
+{
+    int r[4], i, x, y, id;
+    float box[4] = {rect[0], rect[1], rect[0] + rect[2], rect[1] + rect[3]};
+    const index_cell_t *cell;
+    index_prim_t *prim;
+    index_start_query(index);
+    if (!index_cells(index, box, r)) return 0;
+    for (y = r[1]; y <= r[3]; y++)
+    for (x = r[0]; x <= r[2]; x++) {
+        cell = &index->cells[y * index->w + x];
+        for (i = 0; i < cell->nb; i++) {
+            id = cell->ids[i];
+            prim = &index->prims[id];
+            if (prim->stamp == index->stamp) continue;
+            prim->stamp = index->stamp;
+            if (prim->box[0] > box[2] || prim->box[2] < box[0] ||
+                prim->box[1] > box[3] || prim->box[3] < box[1]) continue;
+            index_hit(index, id, 0);
+        }
+    }
+    return index_results(index, hits, size, hit_id_cmp);
+}
+
+// Distance along a ray to the first intersection with a primitive, or
+// a negative value if the ray doesn't hit it.
+static float prim_ray(const noctt_index_t *index, const index_prim_t *prim,
+                      float x, float y, float dx, float dy, float len)
+{
+    int i;
+    float ex, ey, d, t, u, ret = -1;
+    const noctt_vec3_t *v = index->verts + prim->ofs, *a, *b;
+    if (prim_contains(index, prim, x, y)) return 0;
+    for (i = 0; i < prim->n; i++) {
+        a = &v[i];
+        b = &v[(i + 1) % prim->n];
+        ex = b->x - a->x;
+        ey = b->y - a->y;
+        d = dx * ey - dy * ex;
+        if (d == 0) continue;
+        t = ((a->x - x) * ey - (a->y - y) * ex) / d;
+        u = ((a->x - x) * dy - (a->y - y) * dx) / d;
+        if (t < 0 || t > len || u < 0 || u > 1) continue;
+        if (ret < 0 || t < ret) ret = t;
+    }
+    return ret;
+}
+
+int noctt_index_ray(noctt_index_t *index, float x, float y,
+                    float dx, float dy, float len,
+                    noctt_hit_t *hits, int size)
+{
+    int i, id, cx, cy, step[2];
+    float norm, t, t_end, t_max[2], t_delta[2], dist, x0, y0;
+    const index_cell_t *cell;
+    index_prim_t *prim;
+
+    index_start_query(index);
+    norm = sqrt(dx * dx + dy * dy);
+    if (norm == 0) return 0;
+    dx /= norm;
+    dy /= norm;
+
+    // Clip the ray to the grid.
+    t = 0;
+    t_end = len;
+    if (!clip_ray(index->rect, x, y, dx, dy, &t, &t_end)) return 0;
+    x0 = x + t * dx - index->rect[0];
+    y0 = y + t * dy - index->rect[1];
+    cx = min(index->w - 1, max(0, (int)floor(x0 / index->cell_size)));
+    cy = min(index->h - 1, max(0, (int)floor(y0 / index->cell_size)));
+
+    // Walk along the cells.
+    step[0] = dx >= 0 ? +1 : -1;
+    step[1] = dy >= 0 ? +1 : -1;
+    t_delta[0] = dx ? fabs(index->cell_size / dx) : INFINITY;
+    t_delta[1] = dy ? fabs(index->cell_size / dy) : INFINITY;
+    t_max[0] = dx ? t + ((cx + (dx > 0)) * index->cell_size - x0) / dx
+                  : INFINITY;
+    t_max[1] = dy ? t + ((cy + (dy > 0)) * index->cell_size - y0) / dy
+                  : INFINITY;
+    while (true) {
+        cell = &index->cells[cy * index->w + cx];
+        for (i = 0; i < cell->nb; i++) {
+            id = cell->ids[i];
+            prim = &index->prims[id];
+            if (prim->stamp == index->stamp) continue;
+            prim->stamp = index->stamp;
+            dist = prim_ray(index, prim, x, y, dx, dy, len);
+            if (dist >= 0) index_hit(index, id, dist);
+        }
+        if (t_max[0] < t_max[1]) {
+            if (t_max[0] > t_end) break;
+            t = t_max[0];
+            t_max[0] += t_delta[0];
+            cx += step[0];
+            if (cx < 0 || cx >= index->w) break;
+        } else {
+            if (t_max[1] > t_end) break;
+            t = t_max[1];
+            t_max[1] += t_delta[1];
+            cy += step[1];
+            if (cy < 0 || cy >= index->h) break;
+        }
+    }
+    return index_results(index, hits, size, hit_dist_cmp);
+}
+
+// Memoization of CALL_MEMO.  The result of a call only depends on the rule,
+// the random seed, the scale, the color, the flags and the vars of the
+// turtle, so we render it once in the local frame of the turtle with a
+// separate program, and then replay the primitives with the turtle matrix.
+
+#define MEMO_NB_BUCKETS 1024
+// Max number of points kept in the cache.  When it is full we clear it.
+#define MEMO_MAX_POINTS (1 << 20)
+// Max number of iterations of a memoized rule.  The rules that don't end
+// before are not memoized.
+#define MEMO_MAX_ITER 1024
+// Initial pool size of the programs used to record the rules.  We retry
+// with a bigger pool (up to the one of the program) if it gets full.
+#define MEMO_POOL_SIZE 64
+
+typedef struct {
+    noctt_rule_func_t   rule;
+    float               key;
+    float               scale[2];
+    float               color[4];
+    unsigned int        flags;
+    float               vars[NOCTT_NB_VARS];
+} memo_key_t;
+
+typedef struct {
+    int             n;
+    unsigned int    flags;
+    float           color[4];
+} memo_prim_t;
+
+typedef struct memo_entry memo_entry_t;
+struct memo_entry {
+    memo_entry_t    *next;
+    memo_key_t      key;
+    unsigned long   hash;
+    bool            call;   // Didn't end: use a normal CALL.
+    int             nb_prims, nb_points;
+    memo_prim_t     *prims;
+    noctt_vec3_t    *points;
+};
+
+struct noctt_memo {
+    memo_entry_t    *buckets[MEMO_NB_BUCKETS];
+    int             nb_points;
+};
+
+static unsigned long memo_hash(const memo_key_t *key)
+{
+    // FNV-1a.
+    const unsigned char *p = (const unsigned char*)key;
+    unsigned long h = 2166136261UL;
+    size_t i;
+    for (i = 0; i < sizeof(*key); i++) {
+        h ^= p[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static void memo_record(int n, const noctt_vec3_t *poly, const float color[4],
+                        unsigned int flags, void *user_data)
+{
+    memo_entry_t *e = (memo_entry_t*)user_data;
+    memo_prim_t *prim;
+    e->prims = (memo_prim_t*)realloc(e->prims,
+                                     (e->nb_prims + 1) * sizeof(*e->prims));
+    e->points = (noctt_vec3_t*)realloc(e->points,
+                                (e->nb_points + n) * sizeof(*e->points));
+    prim = &e->prims[e->nb_prims++];
+    prim->n = n;
+    prim->flags = flags;
+    memcpy(prim->color, color, sizeof(prim->color));
+    memcpy(&e->points[e->nb_points], poly, n * sizeof(*poly));
+    e->nb_points += n;
+}
+
+static void memo_entry_clear(memo_entry_t *e)
+{
+    free(e->prims);
+    free(e->points);
+    e->prims = NULL;
+    e->points = NULL;
+    e->nb_prims = 0;
+    e->nb_points = 0;
+}
+
+// Record a rule with a sub program of a given pool size.  Return false if
+// the pool got full.
+static bool memo_record_rule(noctt_prog_t *prog, memo_entry_t *e, int nb)
+{
+    const memo_key_t *key = &e->key;
+    float identity[16];
+    noctt_prog_t *sub;
+    noctt_turtle_t *tur;
+    bool ret;
+
+    mat_set_identity(identity);
+    sub = noctt_prog_create(key->rule, nb, 0, identity, prog->pixel_size);
+    sub->min_scale = prog->min_scale;
+    sub->tess_tolerance = prog->tess_tolerance;
+    sub->max_turtles = prog->max_turtles;
+    if (prog->max_prims)
+        sub->max_prims = max(1, prog->max_prims - prog->total_prims);
+    sub->render_callback = memo_record;
+    sub->render_callback_data = e;
+    tur = &sub->turtles[0];
+    memcpy(tur->scale, key->scale, sizeof(tur->scale));
+    memcpy(tur->color, key->color, sizeof(tur->color));
+    memcpy(tur->vars, key->vars, sizeof(tur->vars));
+    tur->flags = key->flags;
+    tur->rand_next = e->hash;
+    // We don't use noctt_prog_run, since a rule that loops with YIELD would
+    // never return.
+    while (sub->active && sub->iter < MEMO_MAX_ITER)
+        noctt_prog_iter(sub);
+    e->call = sub->active;
+    ret = !sub->clone_failures || nb == prog->nb;
+    if (ret && !e->call) {
+        if (sub->degraded) prog->degraded = true;
+        prog->clone_failures += sub->clone_failures;
+    }
+    noctt_prog_delete(sub);
+    return ret;
+}
+
+static memo_entry_t *memo_create(noctt_prog_t *prog,
+                                 const memo_key_t *key, unsigned long hash)
+{
+    int nb = min(MEMO_POOL_SIZE, prog->nb);
+    memo_entry_t *e = (memo_entry_t*)calloc(1, sizeof(*e));
+
+    e->key = *key;
+    e->hash = hash;
+    while (!memo_record_rule(prog, e, nb) && !e->call) {
+        memo_entry_clear(e);
+        nb = min(nb * 2, prog->nb);
+    }
+    // Nothing to replay if we have to do a normal call.
+    if (e->call) memo_entry_clear(e);
+    return e;
+}
+
+static void memo_clear(struct noctt_memo *memo)
+{
+    int i;
+    memo_entry_t *e;
+    for (i = 0; i < MEMO_NB_BUCKETS; i++) {
+        while ((e = memo->buckets[i])) {
+            memo->buckets[i] = e->next;
+            free(e->prims);
+            free(e->points);
+            free(e);
+        }
+    }
+    memo->nb_points = 0;
+}
+
+static void memo_delete(struct noctt_memo *memo)
+{
+    if (!memo) return;
+    memo_clear(memo);
+    free(memo);
+}
+
+// Return false if the call can't be memoized, the caller then does a
+// normal CALL.
+bool noctt_call_memo(noctt_turtle_t *turtle, noctt_rule_func_t rule,
+                     float key, int n, const float *ops)
+{
+    noctt_prog_t *prog = turtle->prog;
+    prim_t state;
+    memo_key_t mkey;
+    memo_entry_t *e;
+    unsigned long hash;
+    noctt_vec3_t *points;
+    int i, ofs;
+    float vars[NOCTT_NB_VARS];
+
+    if (prog->cull_rect[2] > 0 && prog->cull_rect[3] > 0) return false;
+    memcpy(vars, turtle->vars, sizeof(vars));
+    prim_init(&state, turtle, 0, NULL);
+    tr(prog, state.mat, state.scale, state.color, &state.flags, vars,
+       n, ops);
+    turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED;
+    if (too_small_scale(prog, state.scale)) {
+        split_seed(turtle);
+        return true;
+    }
+
+    memset(&mkey, 0, sizeof(mkey));
+    mkey.rule = rule;
+    mkey.key = key;
+    memcpy(mkey.scale, state.scale, sizeof(mkey.scale));
+    memcpy(mkey.color, state.color, sizeof(mkey.color));
+    mkey.flags = state.flags;
+    memcpy(mkey.vars, vars, sizeof(mkey.vars));
+    hash = memo_hash(&mkey);
+
+    if (!prog->memo)
+        prog->memo = (struct noctt_memo*)calloc(1, sizeof(*prog->memo));
+    for (e = prog->memo->buckets[hash % MEMO_NB_BUCKETS]; e; e = e->next) {
+        if (e->hash == hash && memcmp(&e->key, &mkey, sizeof(mkey)) == 0)
+            break;
+    }
+    if (!e) {
+        e = memo_create(prog, &mkey, hash);
+        if (prog->memo->nb_points + e->nb_points > MEMO_MAX_POINTS)
+            memo_clear(prog->memo);
+        prog->memo->nb_points += e->nb_points;
+        e->next = prog->memo->buckets[hash % MEMO_NB_BUCKETS];
+        prog->memo->buckets[hash % MEMO_NB_BUCKETS] = e;
+    }
+    if (e->call) return false;
+    // Advance the random generator as a CALL would.
+    split_seed(turtle);
+
+    points = (noctt_vec3_t*)malloc(e->nb_points * sizeof(*points));
+    for (i = 0; i < e->nb_points; i++)
+        points[i] = mat_mul_vec(state.mat, e->points[i]);
+    for (i = 0, ofs = 0; i < e->nb_prims; i++) {
+        render(prog, e->prims[i].n, points + ofs, e->prims[i].color,
+               e->prims[i].flags);
+        ofs += e->prims[i].n;
+    }
+    free(points);
+    return true;
+}
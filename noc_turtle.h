@@ -109,6 +109,32 @@
  * An other way is to use the TRANSFORM_SPAWN macro, that runs a block in
  * the context of the new turtle.
  *
+ * If we need to wait for several spawned turtles to finish, we can use
+ * JOIN, that blocks the turtle until all the turtles it created (and the
+ * turtles they created themselves) are dead:
+ *
+ *     LOOP(4, R, 90) {
+ *         SPAWN(a_rule, X, 1);
+ *     }
+ *     JOIN();
+ *     CIRCLE();   // Rendered after all the a_rule turtles are done.
+ *
+ * If a rule is called many times with the same parameters, for example
+ * to render the same building in several places, we can use CALL_MEMO:
+ *
+ *     CALL_MEMO(building, 1, X, 2);
+ *
+ * The first call runs the rule to completion and records the primitives it
+ * renders.  The next calls with the same rule, key, scale, color, flags
+ * and vars just render the recorded primitives at the new position.  The
+ * random seed of the call is derived from the key instead of the turtle,
+ * so use different keys to get different variations.  The recorded rule
+ * runs as if in a single iteration, so YIELD has no effect there.  If it
+ * doesn't end after 1024 iterations, or if the program has a cull_rect
+ * (what gets culled depends on the position), the call is not memoized
+ * and runs as a normal CALL.  The budgets of the program also apply to the
+ * recorded rule.
+ *
  * Looping
  * -------
  *
@@ -162,6 +188,82 @@
  *         noctt_prg_iter(prog);
  *     }
  *
+ * For interactive previews, we can set prog->sched to NOCTT_SCHED_SCALE, so
+ * that the turtles with the biggest screen size are run first, and limit the
+ * work done at each iteration with prog->iter_budget.  This way an
+ * interrupted generation shows the big shapes first, and the fine details
+ * come later.  The turtles are only sorted when the budget is too small for
+ * all of them: otherwise they run in pool order.
+ *
+ * To protect against rules that explode, we can set prog->max_prims (total
+ * number of rendered primitives) and prog->max_turtles (number of turtles
+ * alive at the same time).  Once half of a budget is used, the minimum scale
+ * under which new clones and calls don't start is progressively raised, so
+ * that the smallest branches are dropped first, and when a limit is reached
+ * nothing more is started.  The turtles already running continue.
+ * prog->degraded is set if anything got dropped this way.
+ *
+ * If we only care about the final image (offline generation), we can
+ * instead call noctt_prog_run, that executes the program to completion in
+ * a single call.  The turtles are run depth first, so that the number of
+ * alive turtles stays low, and YIELD is ignored.  Since every turtle has its
+ * own random generator, the set of rendered primitives is the same as
+ * with noctt_prog_iter, only the order changes.  Don't use it with rules
+ * that never end!
+ *
+ *     noctt_prog_run(prog);
+ *
+ * If only a part of the scene is visible, we can give the bounds of the
+ * rules, and a cull rectangle in the render space.  The turtles that start
+ * a rule whose bounds are outside the rectangle are killed immediately:
+ *
+ *     static const noctt_rule_t rules[] = {
+ *         {building, "building", 1.5},  // Radius in the turtle space.
+ *         {antenna,  "antenna",  2},
+ *     };
+ *     noctt_prog_set_rules(prog, rules, 2);
+ *     prog->cull_rect[0] = 0;     // x
+ *     prog->cull_rect[1] = 0;     // y
+ *     prog->cull_rect[2] = 640;   // width
+ *     prog->cull_rect[3] = 480;   // height
+ *
+ * The state of a program can be saved at any time between two iterations,
+ * and loaded later, even in another process.  The rules are saved as their
+ * index in a table given by the client, that should list all the rules of
+ * the program:
+ *
+ *     size = noctt_prog_save(prog, rules, nb_rules, NULL);
+ *     buf = malloc(size);
+ *     noctt_prog_save(prog, rules, nb_rules, buf);
+ *     ...
+ *     prog = noctt_prog_load(buf, size, rules, nb_rules);
+ *     prog->render_callback = my_render_callback;
+ *
+ * To find out which rules are slow, compile noc_turtle.c with
+ * NOCTT_PROFILE defined.  The program then counts, for each rule, the
+ * number of calls, resumes, clones, primitives and vertices, and the time
+ * spent in it.  We can get them with noctt_prog_stats, or print them:
+ *
+ *     noctt_prog_dump_stats(prog);
+ *
+ * With NOCTT_TRACE defined, we can also record the timeline of the
+ * scheduling, to see in Perfetto how the turtles run and wait for each
+ * other:
+ *
+ *     noctt_prog_trace(prog, 100000);  // Max number of events kept.
+ *     ...
+ *     noctt_prog_trace_export(prog, "trace.json");
+ *
+ * To also use the rendered primitives for picking or collisions, we can
+ * let the program fill a spatial index as it renders, and query it at any
+ * time:
+ *
+ *     float rect[4] = {-320, -240, 640, 480};  // Area covered.
+ *     noctt_hit_t hits[8];
+ *     prog->index = noctt_index_create(rect, 16);   // Cell size.
+ *     ...
+ *     nb = noctt_index_point(prog->index, x, y, hits, 8);
+ *
  * Finally when we are done, we can delete the program:
  *
  *     noctt_prog_delete(prog);
@@ -291,12 +393,38 @@
 /* Notes about the implementation
  * ------------------------------
  *
+ * CALL and TRANSFORM don't create a new turtle: the current state of the
+ * turtle is saved in a frame, and restored when the called rule (or the
+ * block) ends.  KILL and END in a called rule thus only return to the
+ * caller.  If the program runs out of frames, we fall back to cloning the
+ * turtle and waiting for the clone to die.
+ *
+ * LOOP works the same way: the loop counter and the accumulated transformation
+ * live in a first frame, and each iteration of the block runs in a frame
+ * pushed on top of it.
+ *
+ * Since a called rule or a loop iteration runs at once inside the calling
+ * turtle, its primitives are rendered before the ones of the turtles that
+ * come after it in the pool.  When the calls were done with clones they
+ * came later in the iteration, so the draw order changed: renderers that
+ * depend on it (depth test with GL_LEQUAL, blending) can show coplanar
+ * overlaps differently.  The set of primitives is the same.
+ *
+ * The random generator is per turtle: each clone and each call gets a new
+ * seed split from the generator of its parent, and the parent generator
+ * moves on.  Before, all the turtles shared the generator of the program,
+ * so an existing rule gives a different output for the same seed, with
+ * noctt_prog_iter too, not only with noctt_prog_run.  The output now only
+ * depends on the seed and the rules, not on the scheduling (as long as the
+ * pool doesn't get full).
+ *
  * Yes, the code is hard to follow, this is what we get from abusing the
  * C language to fake coroutines.
  *
  * The rules are all really based around a big switch that jumps to the
- * current state.  This has some important implications in what we can do
- * inside the rules:
+ * current state (or an indirect goto if NOCTT_COMPUTED_GOTO is defined
+ * before including this file).  This has some important implications in
+ * what we can do inside the rules:
  *
  *     - Since the code make heavy use of the __LINE__ macro, it is not
  *       possible to put two of them on the same line!  So do not write
@@ -313,6 +441,9 @@
  *     - However, it is perfectly fine to call any C functions, which is one
  *       of the advantage over using a script language.
  *
+ * With a C++20 compiler, noc_turtle_coro.h allows to write the rules as real
+ * coroutines, without those limitations.
+ *
  */
 
 
@@ -362,8 +493,10 @@
 #undef END
 #undef YIELD
 #undef CALL
+#undef CALL_MEMO
 #undef JUMP
 #undef SPAWN
+#undef JOIN
 #undef KILL
 
 #undef SQUARE
@@ -406,8 +539,10 @@
 #define END           NOCTT_END
 #define YIELD(...)    NOCTT_YIELD(__VA_ARGS__)
 #define CALL(...)     NOCTT_CALL(__VA_ARGS__)
+#define CALL_MEMO(...) NOCTT_CALL_MEMO(__VA_ARGS__)
 #define JUMP(...)     NOCTT_JUMP(__VA_ARGS__)
 #define SPAWN(...)    NOCTT_SPAWN(__VA_ARGS__)
+#define JOIN()        NOCTT_JOIN()
 #define KILL()        NOCTT_KILL()
 
 #define SQUARE(...)            NOCTT_SQUARE(__VA_ARGS__)
@@ -445,6 +580,44 @@ typedef struct {
 typedef struct noctt_turtle noctt_turtle_t;
 typedef void (*noctt_rule_func_t)(noctt_turtle_t*);
 typedef struct noctt_prog noctt_prog_t;
+struct noctt_memo;
+struct noctt_tess;
+struct noctt_profile;
+struct noctt_trace;
+typedef struct noctt_index noctt_index_t;
+
+// Optional informations about a rule, set with noctt_prog_set_rules.
+typedef struct {
+    noctt_rule_func_t   func;
+    const char          *name;
+    // Radius of a circle centered on the turtle that contains everything
+    // the rule (and the rules it spawns) renders, in the turtle space.  0
+    // if unknown.
+    float               radius;
+} noctt_rule_t;
+
+// State of a turtle saved by CALL and TRANSFORM, and restored when the
+// called rule ends.
+typedef struct {
+    int                 prev;    // Previous frame in the stack, or -1.
+    noctt_rule_func_t   func;
+    int                 step;
+    void                *resume;
+    float               mat[16];
+    float               scale[2];
+    float               color[4];
+    unsigned int        flags;
+    int                 n, i, tmp;
+    float               vars[NOCTT_NB_VARS];
+    unsigned long       rand_next;
+    int                 children; // Children created before the call.
+} noctt_frame_t;
+
+// Number of call frames allocated per turtle in the pool.  If we run out
+// of frames, CALL falls back to cloning the turtle.
+#ifndef NOCTT_NB_FRAMES
+#   define NOCTT_NB_FRAMES 4
+#endif
 
 struct noctt_turtle {
     noctt_prog_t        *prog;
@@ -456,9 +629,27 @@ struct noctt_turtle {
     unsigned int        iflags;  // Internal flags.
     unsigned int        flags;   // User defined flags.
     int                 step;
+    void                *resume; // Used instead of step with computed goto.
     int                 time;
     int                 n, i, tmp;
     float               vars[NOCTT_NB_VARS];
+    int                 wake;    // Iteration at which a sleeping turtle wakes.
+    int                 next;    // Next sleeping turtle in the same wheel slot.
+    // Tree of the alive turtles, used by JOIN.  When a turtle dies, its
+    // children are adopted by its parent.
+    int                 parent;
+    int                 parent_depth; // Call depth of the parent at creation.
+    int                 children; // Number of alive children.
+    int                 first_child, prev_sibling, next_sibling;
+    int                 frame;   // Top of the call stack, or -1.
+    int                 depth;   // Number of frames in the call stack.
+    // Private data of the rule, released with prog->release_data when the
+    // turtle dies.  Not copied to the clones.
+    void                *data;
+    // Each turtle has its own random generator state, seeded from its
+    // parent when it is cloned.  This way the result of a rule only depends
+    // on its lineage and not on the order the turtles are executed.
+    unsigned long       rand_next;
 };
 
 enum {
@@ -486,11 +677,19 @@ enum {
 // Internal flags.
 enum {
     NOCTT_FLAG_DONE         = 1 << 0,
-    NOCTT_FLAG_JUST_CLONED  = 1 << 1,
+    NOCTT_FLAG_JUST_CLONED  = 1 << 1, // Also set after a frame push.
     NOCTT_FLAG_WAITING      = 1 << 2,
     NOCTT_FLAG_BLOCK_DONE   = 1 << 3,
+    NOCTT_FLAG_WAITED       = 1 << 4, // Another turtle waits for us.
+    NOCTT_FLAG_SLEEPING     = 1 << 5, // In the timer wheel after a YIELD.
+    NOCTT_FLAG_JOINING      = 1 << 6, // Waiting for all the children.
 };
 
+// Number of slots of the timer wheel used for the sleeping turtles.
+#ifndef NOCTT_WHEEL_SIZE
+#   define NOCTT_WHEEL_SIZE 64
+#endif
+
 #define NOCTT_OP_START FLT_MAX
 
 #define NOCTT_S       NOCTT_OP_START, NOCTT_OP_S
@@ -522,71 +721,131 @@ enum {
 // 'n' value for each of them.  If we want to get the same value for two
 // markers, we need to put the same n, but also set the shift of one to the
 // ofset between the two (so that it works with __COUNTER__ too).
+// With __COUNTER__ the markers are relative to a base value defined by
+// NOCTT_START, so that the case values of a rule are small and dense, and
+// the compiler can turn the switch into a jump table.
 #ifdef __COUNTER__
-    #define NOCTT_MARKER(n, shift) (__COUNTER__ + shift)
+    #define NOCTT_MARKER(n, shift) (__COUNTER__ - noctt_base_ + shift)
+    #define NOCTT_BASE_ enum { noctt_base_ = __COUNTER__ };
 #else
     #define NOCTT_MARKER(n, shift) (__LINE__ * 8 + n)
+    #define NOCTT_BASE_
+#endif
+
+// NOCTT_SAVE_(n) saves the point where the rule will resume, and
+// NOCTT_RESUME_(n) marks it.  If NOCTT_COMPUTED_GOTO is defined (only with
+// gcc and clang), we store the address of a label in turtle->resume and
+// resume with a single indirect jump instead of the switch.  The labels use
+// __LINE__, so in that case we can never put two of them on the same line.
+#if defined(NOCTT_COMPUTED_GOTO) && defined(__GNUC__)
+    #define NOCTT_RESUME_LABEL__(n, line) noctt_resume_ ## line ## _ ## n
+    #define NOCTT_RESUME_LABEL_(n, line) NOCTT_RESUME_LABEL__(n, line)
+    #define NOCTT_SAVE_(n) \
+        turtle->resume = &&NOCTT_RESUME_LABEL_(n, __LINE__)
+    #define NOCTT_RESUME_(n) NOCTT_RESUME_LABEL_(n, __LINE__):;
+    #define NOCTT_SWITCH_ \
+        if (turtle->resume) goto *turtle->resume; \
+        {
+#else
+    #define NOCTT_SAVE_(n) turtle->step = NOCTT_MARKER(n, 1)
+    #define NOCTT_RESUME_(n) case NOCTT_MARKER(n, 0):;
+    #define NOCTT_SWITCH_ \
+        NOCTT_BASE_ \
+        switch (turtle->step) { \
+            case 0:;
 #endif
 
+// Restart the turtle at the beginning of its rule.
+#define NOCTT_RESTART_ do { \
+    turtle->step = 0; \
+    turtle->resume = NULL; \
+} while (0)
+
 #define NOCTT_TR(...) do { \
         const float ops_[] = {__VA_ARGS__}; \
         noctt_tr(turtle, sizeof(ops_) / sizeof(float), ops_); \
     } while (0)
 
-#define NOCTT_START \
-    switch (turtle->step) {          \
-        case 0:;
+#define NOCTT_START NOCTT_SWITCH_
 
 #define NOCTT_END   \
         NOCTT_KILL(); \
     }
 
+// The primitives only need the turtle transformation and color, so we don't
+// copy the turtle, the ops are passed to the *_tr functions.
 #define NOCTT_PRIMITIVE_(func, ...) do { \
     const float ops_[] = {__VA_ARGS__}; \
-    noctt_turtle_t turtle_ = *turtle; \
-    noctt_tr(&turtle_, sizeof(ops_) / sizeof(float), ops_); \
+    const int nops_ = sizeof(ops_) / sizeof(float); \
     func; \
 } while (0)
 
 #define NOCTT_SQUARE(...)      \
-    NOCTT_PRIMITIVE_(noctt_square(&turtle_), __VA_ARGS__)
+    NOCTT_PRIMITIVE_(noctt_square_tr(turtle, nops_, ops_), __VA_ARGS__)
 #define NOCTT_RSQUARE(r, ...)  \
-    NOCTT_PRIMITIVE_(noctt_rsquare(&turtle_, r), __VA_ARGS__)
+    NOCTT_PRIMITIVE_(noctt_rsquare_tr(turtle, r, nops_, ops_), __VA_ARGS__)
 #define NOCTT_CIRCLE(...)      \
-    NOCTT_PRIMITIVE_(noctt_circle(&turtle_), __VA_ARGS__)
+    NOCTT_PRIMITIVE_(noctt_circle_tr(turtle, nops_, ops_), __VA_ARGS__)
 #define NOCTT_STAR(n, t, c, ...) \
-    NOCTT_PRIMITIVE_(noctt_star(&turtle_, n, t, c), __VA_ARGS__)
+    NOCTT_PRIMITIVE_(noctt_star_tr(turtle, n, t, c, nops_, ops_), __VA_ARGS__)
 #define NOCTT_POLY(n, p, ...) \
-    NOCTT_PRIMITIVE_(noctt_poly(&turtle_, n, p), __VA_ARGS__)
+    NOCTT_PRIMITIVE_(noctt_poly_tr(turtle, n, p, nops_, ops_), __VA_ARGS__)
 #define NOCTT_TRIANGLE(...)    NOCTT_STAR(3, 0, 0, ##__VA_ARGS__)
 
 #define NOCTT_COMMA_ ,
 #define NOCTT_YIELD_(_, n_, ...) do { \
-    turtle->tmp = n_; \
-    turtle->step = NOCTT_MARKER(0, 1); \
-    case NOCTT_MARKER(0, 0):; \
-    if (turtle->tmp--) { \
-        turtle->iflags |= NOCTT_FLAG_DONE; \
-        return; \
-    } \
+    NOCTT_SAVE_(0); \
+    if (noctt_yield(turtle, n_)) return; \
+    NOCTT_RESUME_(0) \
 } while (0)
 #define NOCTT_YIELD(...) NOCTT_YIELD_(0, ##__VA_ARGS__, 1)
 
+#define NOCTT_JOIN() do { \
+    NOCTT_SAVE_(0); \
+    if (noctt_join(turtle)) return; \
+    NOCTT_RESUME_(0) \
+} while (0)
 
+
+// With mode 1 (CALL and TRANSFORM) we first try to push a frame and
+// continue in the same turtle.  The turtle then has the JUST_CLONED flag
+// set, as if it was the clone.
 #define NOCTT_CLONE(mode, ...) do { \
-    turtle->step = NOCTT_MARKER(0, 1); \
+    NOCTT_SAVE_(0); \
     const float ops_[] = {__VA_ARGS__}; \
-    noctt_clone(turtle, mode, sizeof(ops_) / sizeof(float), ops_); \
-    if (mode == 1) return; \
+    if (mode == 0) \
+        noctt_clone(turtle, 0, sizeof(ops_) / sizeof(float), ops_); \
+    else if (noctt_call(turtle, sizeof(ops_) / sizeof(float), ops_)) \
+        return; \
     } while (0); \
-    case NOCTT_MARKER(0, 0):; \
+    NOCTT_RESUME_(0) \
 
 #define NOCTT_CALL(rule, ...) do { \
     NOCTT_CLONE(1, ##__VA_ARGS__); \
     if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) { \
         turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED; \
         turtle->func = rule; \
-        turtle->step = 0; \
+        NOCTT_RESTART_; \
+        return; \
+    } \
+} while (0)
+
+// If the call can't be memoized, we do a normal CALL.
+#define NOCTT_CALL_MEMO(rule, key, ...) do { \
+    NOCTT_SAVE_(0); \
+    do { \
+        const float ops_[] = {__VA_ARGS__}; \
+        if (noctt_call_memo(turtle, rule, key, \
+                            sizeof(ops_) / sizeof(float), ops_)) \
+            break; \
+        if (noctt_call(turtle, sizeof(ops_) / sizeof(float), ops_)) \
+            return; \
+    } while (0); \
+    NOCTT_RESUME_(0) \
+    if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) { \
+        turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED; \
+        turtle->func = rule; \
+        NOCTT_RESTART_; \
         return; \
     } \
 } while (0)
@@ -594,7 +853,7 @@ enum {
 #define NOCTT_JUMP(rule, ...) do { \
     TR(__VA_ARGS__); \
     turtle->func = rule; \
-    turtle->step = 0; \
+    NOCTT_RESTART_; \
     return; \
 } while (0)
 
@@ -603,7 +862,7 @@ enum {
     if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) { \
         turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED; \
         turtle->func = rule; \
-        turtle->step = 0; \
+        NOCTT_RESTART_; \
         return; \
     } \
 } while (0)
@@ -649,23 +908,20 @@ enum {
     turtle->tmp = n_; \
     NOCTT_CLONE(1); \
     if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) { \
-        turtle->step = NOCTT_MARKER(1, 1); case NOCTT_MARKER(1, 0):; \
+        turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED; \
         turtle->n = turtle->tmp; \
         for (turtle->i = 0; turtle->i < turtle->n; turtle->i++) { \
-            turtle->step = NOCTT_MARKER(2, 1); \
-            noctt_clone(turtle, 1, 0, 0); \
+            NOCTT_SAVE_(1); \
+            if (noctt_call(turtle, 0, NULL)) return; \
+            NOCTT_RESUME_(1) \
+            if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) \
+                goto NOCTT_UNIQ_LABEL(1); \
             NOCTT_TR(__VA_ARGS__); \
-            return; \
-            case NOCTT_MARKER(2, 0):; \
-            if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) { \
-                turtle->step = NOCTT_MARKER(3, 1); \
-                return; \
-            } \
         } \
         noctt_kill(turtle); \
         return; \
     } \
-    case NOCTT_MARKER(3, 0):; \
+    NOCTT_UNIQ_LABEL(1):; \
     if (turtle->iflags & NOCTT_FLAG_JUST_CLONED) \
         NOCTT_RUN_BLOCK_AND_KILL_
 
@@ -679,26 +935,216 @@ void noctt_circle(const noctt_turtle_t *turtle);
 void noctt_star(const noctt_turtle_t *turtle, int n, float t, float c);
 void noctt_poly(const noctt_turtle_t *turtle, int n, const noctt_vec3_t *poly);
 
+// Same as above, but first apply some operations to the turtle
+// transformation and color, without modifying the turtle.
+void noctt_square_tr(const noctt_turtle_t *turtle, int nops, const float *ops);
+void noctt_rsquare_tr(const noctt_turtle_t *turtle, float r,
+                      int nops, const float *ops);
+void noctt_circle_tr(const noctt_turtle_t *turtle, int nops, const float *ops);
+void noctt_star_tr(const noctt_turtle_t *turtle, int n, float t, float c,
+                   int nops, const float *ops);
+void noctt_poly_tr(const noctt_turtle_t *turtle, int n,
+                   const noctt_vec3_t *poly, int nops, const float *ops);
+
 void noctt_kill(noctt_turtle_t *turtle);
+bool noctt_yield(noctt_turtle_t *turtle, int n);
+bool noctt_join(noctt_turtle_t *turtle);
 void noctt_tr(noctt_turtle_t *turtle, int n, const float *ops);
-void noctt_clone(noctt_turtle_t *turtle, int mode, int n, const float *ops);
+noctt_turtle_t *noctt_clone(noctt_turtle_t *turtle, int mode,
+                            int n, const float *ops);
+bool noctt_call(noctt_turtle_t *turtle, int n, const float *ops);
+bool noctt_call_memo(noctt_turtle_t *turtle, noctt_rule_func_t rule,
+                     float key, int n, const float *ops);
 
 typedef void (*noctt_render_func_t)(int n, const noctt_vec3_t *poly,
                                     const float color[4],
                                     unsigned int flags, void *user_data);
 
+// A primitive stored in a batch.
+typedef struct {
+    int             n;          // Number of vertices.
+    unsigned int    flags;
+    float           color[4];
+    noctt_vec3_t    poly[];
+} noctt_prim_t;
+
+// A list of primitives stored contiguously in memory.  Use noctt_batch_next
+// to iterate them.
+typedef struct {
+    int     nb;                 // Number of primitives.
+    int     size;               // Size of the data in bytes.
+    int     allocated;
+    char    *data;
+} noctt_batch_t;
+
+typedef void (*noctt_batch_func_t)(const noctt_batch_t *batch,
+                                   void *user_data);
+
+void noctt_batch_add(noctt_batch_t *batch, int n, const noctt_vec3_t *poly,
+                     const float color[4], unsigned int flags);
+// Return the primitive after prim, or the first one if prim is NULL.
+// Return NULL at the end.
+const noctt_prim_t *noctt_batch_next(const noctt_batch_t *batch,
+                                     const noctt_prim_t *prim);
+void noctt_batch_clear(noctt_batch_t *batch);
+void noctt_batch_release(noctt_batch_t *batch);
+
+// Spatial index of the rendered primitives, used to know what is at a given
+// position.  The primitives ids are their rendering order.  Only the
+// primitives inside the (x, y, w, h) rect given at creation are indexed.
+typedef struct {
+    int             id;
+    unsigned int    flags;
+    float           dist;       // Distance along the ray for ray queries.
+} noctt_hit_t;
+
+noctt_index_t *noctt_index_create(const float rect[4], float cell_size);
+void noctt_index_delete(noctt_index_t *index);
+void noctt_index_clear(noctt_index_t *index);
+// Add a primitive and return its id.
+int noctt_index_add(noctt_index_t *index, int n, const noctt_vec3_t *poly,
+                    unsigned int flags);
+// Return the vertices of a primitive.
+const noctt_vec3_t *noctt_index_get(const noctt_index_t *index, int id,
+                                    int *n, unsigned int *flags);
+// The queries put at most size hits into hits, and return the number of
+// hits put.  The point and rect queries return the top most primitives
+// first, the ray query the closest ones first.  The rect query only
+// checks the bounding boxes of the primitives.
+int noctt_index_point(noctt_index_t *index, float x, float y,
+                      noctt_hit_t *hits, int size);
+int noctt_index_rect(noctt_index_t *index, const float rect[4],
+                     noctt_hit_t *hits, int size);
+int noctt_index_ray(noctt_index_t *index, float x, float y,
+                    float dx, float dy, float len,
+                    noctt_hit_t *hits, int size);
+
+typedef void (*noctt_splat_func_t)(const noctt_vec3_t *pos, float size,
+                                   const float color[4],
+                                   unsigned int flags, void *user_data);
+
+// Scheduling policies used by noctt_prog_iter.
+enum {
+    NOCTT_SCHED_SLOT = 0,   // Run the turtles in pool order (default).
+    NOCTT_SCHED_SCALE,      // Run the biggest turtles first (with a budget).
+};
+
 struct noctt_prog {
     int                 nb;         // total number of turtles.
     int                 active;     // number of active turtles.
-    unsigned long       rand_next;
+    int                 iter;       // number of calls to noctt_prog_iter.
     float               pixel_size;
     noctt_render_func_t render_callback;
     void                *render_callback_data;
     // Kill context if x or y scale get below this value.
     float               min_scale;
+    int                 sched;      // NOCTT_SCHED_ value.
+    // Max number of turtle resumes per iteration, 0 for no limit.  The
+    // turtles that didn't get a chance to run continue at the next
+    // iteration.
+    int                 iter_budget;
+    bool                sweeping;   // Last iteration ran out of budget.
+    noctt_turtle_t      **order;    // Used by the scale scheduler.
+    // Bitmap of the slots the sweeps have to visit, see noctt_yield.
+    unsigned long long  *runnable;
+    int                 free_slot;  // No free slot in the pool before it.
+    // Timer wheel of the sleeping turtles, indexed by wake iteration.  Each
+    // slot is a list of turtles linked with their 'next' attribute.
+    int                 wheel[NOCTT_WHEEL_SIZE];
+    bool                resched;    // A turtle got ready during the pass.
+    noctt_frame_t       *frames;    // Pool of call frames.
+    int                 nb_frames;
+    int                 free_frame; // First unused frame, or -1.
+    // Optional limits on the total number of rendered primitives and on
+    // the number of turtles alive (0 for no limit).  When we get close to a
+    // limit, the smallest new turtles don't start, and the degraded flag is
+    // set.
+    int                 max_prims;
+    int                 max_turtles;
+    int                 total_prims;
+    int                 total_turtles;
+    bool                degraded;
+    int                 clone_failures; // Because the pool was full.
+    int                 peak_active;    // Max number of alive turtles.
+    // Stack of turtles used by noctt_prog_run (NULL the rest of the time).
+    int                 *run_stack;
+    int                 run_size;
+    // Called when a turtle with some data dies, and on the remaining turtles
+    // when the program is deleted.
+    void                (*release_data)(noctt_turtle_t *turtle);
+    void                *coro_pool; // Used by noc_turtle_coro.h.
+    struct noctt_memo   *memo;      // Cache of CALL_MEMO results.
+    struct noctt_tess   *tess;      // Cache of the tessellated circles.
+    struct noctt_profile *profile;  // Only used with NOCTT_PROFILE.
+    struct noctt_trace  *trace;     // Only used with NOCTT_TRACE.
+    // Rules informations, sorted by function address.
+    noctt_rule_t        *rules;
+    int                 nb_rules;
+    // If set, turtles starting a rule whose bounds are outside of this
+    // (x, y, w, h) rectangle get killed.
+    float               cull_rect[4];
+    // Max distance in pixels between the rendered circles (or rounded
+    // corners) and the real ones.  If set, the number of vertices depends
+    // on the size on screen, otherwise it is fixed.
+    float               tess_tolerance;
+    // If set, the primitives whose bounding box is smaller than this size
+    // in pixels are not rendered.  Instead, if splat_callback is set, it
+    // gets called with the center and size of the primitive, so that the
+    // client can accumulate the coverage (render_callback_data is passed
+    // as user data).
+    float               min_prim_size;
+    noctt_splat_func_t  splat_callback;
+    // If set, the primitives are clipped against this (x, y, w, h)
+    // rectangle, and the ones completely outside are not rendered.  The
+    // concave primitives (like the stars) crossing the rectangle are
+    // rendered whole, since clipping them would break their triangle fans.
+    float               clip_rect[4];
+    // If set, the primitives are accumulated in batch instead of being sent
+    // to render_callback, and batch_callback gets called with all of them
+    // at the end of each noctt_prog_iter or noctt_prog_run call.  We can
+    // then set merge_quads to merge the axis aligned squares of the same
+    // color into bigger rectangles first.  Only the squares of a run of
+    // consecutive primitives with the same color and flags are merged, so
+    // that the rendering order of the different colors doesn't change.
+    noctt_batch_func_t  batch_callback;
+    noctt_batch_t       batch;
+    bool                merge_quads;
+    // If set, the primitives of the batch that are fully hidden by opaque
+    // primitives in front of them (higher z, or same z and rendered after)
+    // are removed before batch_callback gets called.  A primitive is opaque
+    // if its alpha is 1 and it has none of the transparent_flags.  The
+    // primitives with some of the keep_flags (for example if they write on
+    // a stencil buffer) are never removed.
+    bool                occlusion_cull;
+    unsigned int        transparent_flags;
+    unsigned int        keep_flags;
+    // If set, all the rendered primitives are also added to this index.
+    // The index is owned by the client.
+    noctt_index_t       *index;
     noctt_turtle_t      turtles[];
 };
 
+// Profiling counters, only available if noc_turtle.c is compiled with
+// NOCTT_PROFILE defined.
+typedef struct {
+    noctt_rule_func_t   func;
+    const char          *name;      // From the program rules, or NULL.
+    int                 calls;      // Number of times the rule started.
+    int                 resumes;
+    int                 clones;
+    int                 prims;
+    int                 verts;
+    double              time;       // Total time spent in the rule (s).
+} noctt_rule_stats_t;
+
+typedef struct {
+    int                 nb_rules;
+    noctt_rule_stats_t  *rules;
+    int                 max_active; // Max number of alive turtles.
+    int                 clone_failures; // Because the pool was full.
+} noctt_stats_t;
+
+int noctt_rand(noctt_turtle_t *turtle);
 float noctt_frand(noctt_turtle_t *turtle, float a, float b);
 bool noctt_brand(noctt_turtle_t *turtle, float x);
 float noctt_pm(noctt_turtle_t *turtle, float x, float a);
@@ -707,5 +1153,36 @@ noctt_prog_t *noctt_prog_create(noctt_rule_func_t rule, int nb,
                                 int seed, float rect[16], float pixel_size);
 void noctt_prog_delete(noctt_prog_t *prog);
 void noctt_prog_iter(noctt_prog_t *prog);
+void noctt_prog_run(noctt_prog_t *prog);
+void noctt_prog_set_rules(noctt_prog_t *prog, const noctt_rule_t *rules,
+                          int nb);
+const noctt_rule_t *noctt_prog_get_rule(const noctt_prog_t *prog,
+                                        noctt_rule_func_t func);
+// Return NULL if noc_turtle.c was compiled without NOCTT_PROFILE.
+const noctt_stats_t *noctt_prog_stats(const noctt_prog_t *prog);
+// Print the profiling stats, slowest rules first.
+void noctt_prog_dump_stats(const noctt_prog_t *prog);
+// Start to record the scheduling events (iterations, turtles resumes,
+// clones, kills, waits and wakes, rendered primitives) into a ring buffer
+// of the size last events.  A size of 0 stops the recording.  Only does
+// something if noc_turtle.c is compiled with NOCTT_TRACE defined.
+void noctt_prog_trace(noctt_prog_t *prog, int size);
+// Save the recorded events as a Chrome trace JSON file, that can be opened
+// in Perfetto or chrome://tracing.  Each turtle appears as a thread.
+bool noctt_prog_trace_export(const noctt_prog_t *prog, const char *path);
+// Save the state of a program into buf, and return the size of the
+// snapshot.  If buf is NULL, only return the size.  The rules of the
+// turtles are saved as their index in rules, so that we can load the
+// snapshot in another process of the same program.  Return -1 if a turtle
+// uses a rule not in the table, or has some private data (coroutine rules),
+// or if we are inside noctt_prog_run.
+int noctt_prog_save(const noctt_prog_t *prog, const noctt_rule_t *rules,
+                    int nb_rules, void *buf);
+// Create a program from a snapshot.  The rules are also set with
+// noctt_prog_set_rules.  The callbacks, the index and the CALL_MEMO cache
+// are not saved, so they have to be set again.  Return NULL if the
+// snapshot is invalid.
+noctt_prog_t *noctt_prog_load(const void *buf, int size,
+                              const noctt_rule_t *rules, int nb_rules);
 
 #endif // _NOC_TURTLE_H_
@@ -0,0 +1,288 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "noc_turtle_cache.h"
+
+#define CACHE_MAGIC "NOCTTGC"
+#define CACHE_VERSION 2
+
+// File layout: the header, then the primitives data of all the frames,
+// then the frames index, aligned to 8 bytes.
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    int32_t     rule_id;
+    int32_t     seed;
+    float       pixel_size;
+    float       mat[16];
+    uint32_t    nb_frames;
+    uint32_t    prim_size;  // sizeof(noctt_prim_t), as a sanity check.
+    uint64_t    index;      // Offset of the frames index.
+} file_header_t;
+
+typedef struct {
+    uint64_t    offset;
+    uint32_t    nb;
+    uint32_t    size;
+} file_frame_t;
+
+struct noctt_cache_writer {
+    FILE                *file;
+    noctt_prog_t        *prog;
+    noctt_batch_func_t  batch_callback;
+    void                *render_callback_data;
+    file_header_t       header;
+    file_frame_t        *frames;
+    int                 allocated;
+    uint64_t            offset;
+    bool                error;
+};
+
+struct noctt_cache {
+    void                *data;
+    size_t              size;
+    const file_header_t *header;
+    const file_frame_t  *frames;
+};
+
+static void set_header(file_header_t *header, int rule_id, int seed,
+                       const float mat[16], float pixel_size)
+{
+    int i;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header->version = CACHE_VERSION;
+    header->rule_id = rule_id;
+    header->seed = seed;
+    header->pixel_size = pixel_size;
+    for (i = 0; i < 16; i++)
+        header->mat[i] = mat ? mat[i] : (i % 5 == 0);
+    header->prim_size = sizeof(noctt_prim_t);
+}
+
+static void record(const noctt_batch_t *batch, void *user_data)
+{
+    noctt_cache_writer_t *writer = (noctt_cache_writer_t*)user_data;
+    file_frame_t *frame;
+    const noctt_prim_t *prim = NULL;
+
+    if (writer->header.nb_frames >= (uint32_t)writer->allocated) {
+        writer->allocated = writer->allocated ? writer->allocated * 2 : 64;
+        writer->frames = (file_frame_t*)realloc(writer->frames,
+                            writer->allocated * sizeof(*writer->frames));
+    }
+    frame = &writer->frames[writer->header.nb_frames++];
+    frame->offset = writer->offset;
+    frame->nb = batch->nb;
+    frame->size = batch->size;
+    if (batch->size &&
+            fwrite(batch->data, batch->size, 1, writer->file) != 1)
+        writer->error = true;
+    writer->offset += batch->size;
+
+    if (writer->batch_callback) {
+        writer->batch_callback(batch, writer->render_callback_data);
+    } else if (writer->prog->render_callback) {
+        while ((prim = noctt_batch_next(batch, prim)))
+            writer->prog->render_callback(prim->n, prim->poly, prim->color,
+                                          prim->flags,
+                                          writer->render_callback_data);
+    }
+}
+
+noctt_cache_writer_t *noctt_cache_record(noctt_prog_t *prog, const char *path,
+                                         int rule_id, int seed,
+                                         const float mat[16])
+{
+    noctt_cache_writer_t *writer;
+    FILE *file = fopen(path, "wb");
+    if (!file) return NULL;
+    writer = (noctt_cache_writer_t*)calloc(1, sizeof(*writer));
+    writer->file = file;
+    writer->prog = prog;
+    set_header(&writer->header, rule_id, seed, mat, prog->pixel_size);
+    // The header gets written again at the end, once we know the index.
+    if (fwrite(&writer->header, sizeof(writer->header), 1, file) != 1)
+        writer->error = true;
+    writer->offset = sizeof(writer->header);
+    writer->batch_callback = prog->batch_callback;
+    writer->render_callback_data = prog->render_callback_data;
+    prog->batch_callback = record;
+    prog->render_callback_data = writer;
+    return writer;
+}
+
+bool noctt_cache_finish(noctt_cache_writer_t *writer)
+{
+    bool ret;
+    noctt_prog_t *prog = writer->prog;
+    // Flush what was rendered since the last iteration.
+    if (prog->batch.nb) {
+        record(&prog->batch, writer);
+        noctt_batch_clear(&prog->batch);
+    }
+    prog->batch_callback = writer->batch_callback;
+    prog->render_callback_data = writer->render_callback_data;
+
+    // Pad the data so that the index is aligned.
+    while (writer->offset % sizeof(uint64_t)) {
+        if (fputc(0, writer->file) == EOF) writer->error = true;
+        writer->offset++;
+    }
+    writer->header.index = writer->offset;
+    if (writer->header.nb_frames &&
+            fwrite(writer->frames, sizeof(*writer->frames),
+                   writer->header.nb_frames, writer->file) !=
+            writer->header.nb_frames)
+        writer->error = true;
+    if (fseek(writer->file, 0, SEEK_SET) != 0 ||
+            fwrite(&writer->header, sizeof(writer->header), 1,
+                   writer->file) != 1)
+        writer->error = true;
+    if (fclose(writer->file) != 0) writer->error = true;
+    ret = !writer->error;
+    free(writer->frames);
+    free(writer);
+    return ret;
+}
+
+// Check that the records of a frame add up to its size, so that we never
+// read past the frame data when we iterate its primitives.
+static bool check_frame(const char *data, const file_frame_t *frame)
+{
+    const noctt_prim_t *prim;
+    uint64_t ofs = 0, size;
+    uint32_t i;
+
+    if (frame->size > INT32_MAX || frame->nb > INT32_MAX ||
+            frame->offset % sizeof(float))
+        return false;
+    for (i = 0; i < frame->nb; i++) {
+        if (frame->size - ofs < sizeof(noctt_prim_t)) return false;
+        prim = (const noctt_prim_t*)(data + frame->offset + ofs);
+        if (prim->n < 0) return false;
+        size = sizeof(noctt_prim_t) + (uint64_t)prim->n * sizeof(noctt_vec3_t);
+        if (size > frame->size - ofs) return false;
+        ofs += size;
+    }
+    return ofs == frame->size;
+}
+
+noctt_cache_t *noctt_cache_open(const char *path, int rule_id, int seed,
+                                const float mat[16], float pixel_size)
+{
+    int fd;
+    struct stat st;
+    void *data;
+    file_header_t key;
+    const file_header_t *header;
+    const file_frame_t *frames;
+    noctt_cache_t *cache;
+    uint32_t i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    header = (const file_header_t*)data;
+    set_header(&key, rule_id, seed, mat, pixel_size);
+    key.nb_frames = header->nb_frames;
+    key.index = header->index;
+    if (memcmp(header, &key, sizeof(key)) != 0 ||
+            header->index > (uint64_t)st.st_size ||
+            header->index % sizeof(uint64_t) ||
+            header->nb_frames * sizeof(file_frame_t) >
+                (uint64_t)st.st_size - header->index) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    frames = (const file_frame_t*)((const char*)data + header->index);
+    for (i = 0; i < header->nb_frames; i++) {
+        if (frames[i].offset < sizeof(*header) ||
+                frames[i].offset > header->index ||
+                frames[i].size > header->index - frames[i].offset ||
+                !check_frame((const char*)data, &frames[i])) {
+            munmap(data, st.st_size);
+            return NULL;
+        }
+    }
+    cache = (noctt_cache_t*)calloc(1, sizeof(*cache));
+    cache->data = data;
+    cache->size = st.st_size;
+    cache->header = header;
+    cache->frames = frames;
+    return cache;
+}
+
+void noctt_cache_close(noctt_cache_t *cache)
+{
+    if (!cache) return;
+    munmap(cache->data, cache->size);
+    free(cache);
+}
+
+int noctt_cache_nb_frames(const noctt_cache_t *cache)
+{
+    return cache->header->nb_frames;
+}
+
+void noctt_cache_get_frame(const noctt_cache_t *cache, int frame,
+                           noctt_batch_t *batch)
+{
+    const file_frame_t *f = &cache->frames[frame];
+    batch->nb = f->nb;
+    batch->size = f->size;
+    batch->allocated = 0;
+    batch->data = (char*)cache->data + f->offset;
+}
+
+void noctt_cache_replay(const noctt_cache_t *cache, int frame,
+                        noctt_batch_func_t batch_func,
+                        noctt_render_func_t render_func, void *user_data)
+{
+    noctt_batch_t batch;
+    const noctt_prim_t *prim = NULL;
+    noctt_cache_get_frame(cache, frame, &batch);
+    if (batch_func) {
+        batch_func(&batch, user_data);
+        return;
+    }
+    while ((prim = noctt_batch_next(&batch, prim)))
+        render_func(prim->n, prim->poly, prim->color, prim->flags, user_data);
+}
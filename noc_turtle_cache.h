@@ -0,0 +1,92 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Record the primitives rendered by a program into a file, and replay them
+ * later without running the program.
+ *
+ * The file keeps the primitives of each iteration separately, in the same
+ * layout as noctt_batch_t, so that animated rules can be replayed frame by
+ * frame.  It is identified by a rule id chosen by the client, the seed,
+ * the initial matrix and the pixel size of the program, and we can't open
+ * it with different values.  The files are not portable between machines
+ * with different endianness.
+ *
+ * Recording:
+ *
+ *     prog = noctt_prog_create(my_rule, 256, seed, mat, 1);
+ *     prog->render_callback = my_render_callback;    // Still called.
+ *     rec = noctt_cache_record(prog, "level.cache", MY_RULE_ID, seed, mat);
+ *     while (prog->active) noctt_prog_iter(prog);
+ *     noctt_cache_finish(rec);
+ *
+ * Replaying: the file is mapped into memory, and the batches given to the
+ * callback point directly into it.
+ *
+ *     cache = noctt_cache_open("level.cache", MY_RULE_ID, seed, mat, 1);
+ *     if (cache) {
+ *         for (i = 0; i < noctt_cache_nb_frames(cache); i++)
+ *             noctt_cache_replay(cache, i, NULL, my_render_callback, NULL);
+ *         noctt_cache_close(cache);
+ *     }
+ *
+ * This file uses POSIX mmap, compile noc_turtle_cache.c along with
+ * noc_turtle.c.
+ */
+
+#ifndef _NOC_TURTLE_CACHE_H_
+#define _NOC_TURTLE_CACHE_H_
+
+#include "noc_turtle.h"
+
+typedef struct noctt_cache_writer noctt_cache_writer_t;
+typedef struct noctt_cache noctt_cache_t;
+
+// Start to record the primitives of a program.  The batch_callback (or
+// render_callback) of the program keeps getting called.  Return NULL if
+// the file can't be created.
+noctt_cache_writer_t *noctt_cache_record(noctt_prog_t *prog, const char *path,
+                                         int rule_id, int seed,
+                                         const float mat[16]);
+// Finish the file and restore the program callbacks.  Return false if
+// there was an error while writing.
+bool noctt_cache_finish(noctt_cache_writer_t *writer);
+
+// Return NULL if the file doesn't exist, is invalid, or was recorded
+// with different parameters.
+noctt_cache_t *noctt_cache_open(const char *path, int rule_id, int seed,
+                                const float mat[16], float pixel_size);
+void noctt_cache_close(noctt_cache_t *cache);
+int noctt_cache_nb_frames(const noctt_cache_t *cache);
+// Set batch to the primitives of a frame.  The data points into the file
+// mapping, so the batch must not be modified or released, and is only
+// valid until the cache is closed.
+void noctt_cache_get_frame(const noctt_cache_t *cache, int frame,
+                           noctt_batch_t *batch);
+// Send the primitives of a frame to batch_func if set, or else to
+// render_func.
+void noctt_cache_replay(const noctt_cache_t *cache, int frame,
+                        noctt_batch_func_t batch_func,
+                        noctt_render_func_t render_func, void *user_data);
+
+#endif // _NOC_TURTLE_CACHE_H_
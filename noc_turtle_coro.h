@@ -0,0 +1,337 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * C++20 coroutine rules for noc_turtle.
+ *
+ * With this header the rules can be written as real C++20 coroutines
+ * instead of using the START / END macros.  We can then use local variables
+ * and switch blocks.  The nested calls work the same way as CALL: they run
+ * in the calling turtle, with the state saved in a frame.  The programs are
+ * still driven by noctt_prog_iter and noctt_prog_run.
+ *
+ * A rule is a function returning a noctt::rule, whose first argument is the
+ * turtle:
+ *
+ *     noctt::rule my_rule(noctt_turtle_t *turtle)
+ *     {
+ *         for (int i = 0; i < 10; i++) {
+ *             SQUARE(S, 0.9, X, i);
+ *             co_yield 1;                         // YIELD
+ *         }
+ *         co_await noctt::call(turtle, other, X, 1); // CALL
+ *         noctt::spawn(turtle, other, R, 90);      // SPAWN
+ *         co_await noctt::join(turtle);           // JOIN
+ *     }
+ *
+ *     prog = noctt::prog_create(my_rule, 256, 0, mat, 1);
+ *     ...
+ *     noctt::prog_delete(prog);
+ *
+ * The TR and primitive macros work as usual.  The other macros (CALL,
+ * LOOP...) can't be used inside a coroutine rule.
+ *
+ * The coroutine frames are allocated from a pool attached to the program,
+ * so we don't call malloc for each call once the program is running.
+ * The program has to be deleted with noctt::prog_delete to release the
+ * pool.
+ */
+
+#ifndef _NOC_TURTLE_CORO_H_
+#define _NOC_TURTLE_CORO_H_
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "noc_turtle.h"
+
+namespace noctt {
+
+// Pool of coroutine frames, with one free list per size class.  Each block
+// starts with a header telling where it comes from.
+struct pool {
+    enum { GRAIN = 64, NB_CLASSES = 32 };
+    struct alignas(std::max_align_t) block {
+        pool    *owner;  // NULL if we used malloc directly.
+        int     cls;
+        block   *next;
+    };
+    block *free_list[NB_CLASSES] = {};
+
+    void *alloc(std::size_t size) {
+        int cls = (int)((size + GRAIN - 1) / GRAIN);
+        block *b;
+        if (cls >= NB_CLASSES) {
+            b = (block*)std::malloc(sizeof(block) + size);
+            if (!b) throw std::bad_alloc();
+            b->owner = NULL;
+            return b + 1;
+        }
+        b = free_list[cls];
+        if (b) {
+            free_list[cls] = b->next;
+        } else {
+            b = (block*)std::malloc(sizeof(block) + cls * GRAIN);
+            if (!b) throw std::bad_alloc();
+        }
+        b->owner = this;
+        b->cls = cls;
+        return b + 1;
+    }
+
+    static void release(void *p) {
+        block *b = (block*)p - 1;
+        if (!b->owner) {
+            std::free(b);
+            return;
+        }
+        b->next = b->owner->free_list[b->cls];
+        b->owner->free_list[b->cls] = b;
+    }
+
+    ~pool() {
+        int i;
+        block *b;
+        for (i = 0; i < NB_CLASSES; i++) {
+            while ((b = free_list[i])) {
+                free_list[i] = b->next;
+                std::free(b);
+            }
+        }
+    }
+};
+
+// Pool used by the coroutines being created.
+inline thread_local pool *current_pool_ = nullptr;
+
+struct rule {
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle;
+
+    struct promise_type {
+        noctt_turtle_t *turtle;
+        handle          parent;  // The caller, for the called rules.
+        int             depth;   // Call depth of the turtle when created.
+
+        template <class... Args>
+        promise_type(noctt_turtle_t *turtle, Args&&...)
+            : turtle(turtle), depth(turtle->depth) {}
+
+        // We can't get the turtle here without a placement new, that gcc
+        // doesn't match with the delete, so the pool is set by the function
+        // that creates the coroutine.
+        static void *operator new(std::size_t size) {
+            return current_pool_->alloc(size);
+        }
+
+        static void operator delete(void *p, std::size_t) {
+            pool::release(p);
+        }
+
+        rule get_return_object() {
+            return rule(handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // At the end of a called rule we return straight to the caller.
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(handle h) noexcept {
+                promise_type &p = h.promise();
+                if (!p.parent) return std::noop_coroutine();
+                p.turtle->data = p.parent.address();
+                return p.parent;
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        // co_yield n does the same as YIELD(n).
+        struct yield_awaiter {
+            bool ready;
+            bool await_ready() noexcept { return ready; }
+            void await_suspend(std::coroutine_handle<>) noexcept {}
+            void await_resume() noexcept {}
+        };
+        yield_awaiter yield_value(int n) {
+            return yield_awaiter{!noctt_yield(turtle, n)};
+        }
+
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+
+    handle h;
+    explicit rule(handle h) : h(h) {}
+    rule(rule &&other) : h(other.h) { other.h = nullptr; }
+    rule(const rule&) = delete;
+    ~rule() { if (h) h.destroy(); }
+
+    // Give up the ownership of the coroutine.
+    handle release() { handle ret = h; h = nullptr; return ret; }
+};
+
+typedef rule (*rule_func_t)(noctt_turtle_t *turtle);
+
+// Create the coroutine of a rule, using the program pool.
+static inline rule::handle create_(noctt_turtle_t *turtle, rule_func_t func)
+{
+    noctt_prog_t *prog = turtle->prog;
+    if (!prog->coro_pool) prog->coro_pool = new pool();
+    current_pool_ = (pool*)prog->coro_pool;
+    return func(turtle).release();
+}
+
+// The C rule of all the coroutine turtles: resume the innermost coroutine
+// of the turtle, and kill the turtle when its first coroutine is done.
+// If the scheduler ended some calls (because the turtle got too small or
+// was killed), we resume the caller instead, as with CALL.
+static inline void rule_trampoline_(noctt_turtle_t *turtle)
+{
+    rule::handle h = rule::handle::from_address(turtle->data);
+    while (h.promise().depth > turtle->depth) h = h.promise().parent;
+    turtle->data = h.address();
+    h.resume();
+    h = rule::handle::from_address(turtle->data);
+    if (h.done()) noctt_kill(turtle);
+}
+
+// Destroying the first coroutine of a turtle also destroys the coroutines
+// it is waiting for, since they are owned by the call awaiters.
+static inline void release_data_(noctt_turtle_t *turtle)
+{
+    rule::handle h = rule::handle::from_address(turtle->data);
+    while (h.promise().parent) h = h.promise().parent;
+    h.destroy();
+}
+
+static inline void start_(noctt_turtle_t *turtle, rule_func_t func)
+{
+    turtle->prog->release_data = release_data_;
+    turtle->data = create_(turtle, func).address();
+    turtle->func = rule_trampoline_;
+    turtle->step = 0;
+    turtle->resume = NULL;
+}
+
+// co_await call(turtle, func, ops...) does the same as CALL(func, ops...):
+// the turtle state is saved in a frame of the program, and we jump
+// directly into the called coroutine.  If there is no frame left, the rule
+// runs in a clone that we wait for.
+struct call_awaiter {
+    noctt_turtle_t  *turtle;
+    int             depth;  // Call depth of the called rule.
+    rule::handle    h;
+
+    call_awaiter(noctt_turtle_t *turtle, rule_func_t func,
+                 int n, const float *ops) : turtle(turtle), h(nullptr) {
+        noctt_turtle_t *clone;
+        if (!noctt_call(turtle, n, ops)) {
+            turtle->iflags &= ~NOCTT_FLAG_JUST_CLONED;
+            depth = turtle->depth;
+            h = create_(turtle, func);
+            return;
+        }
+        depth = -1;
+        if (turtle->iflags & NOCTT_FLAG_WAITING) {
+            clone = &turtle->prog->turtles[turtle->wait];
+            clone->iflags &= ~NOCTT_FLAG_JUST_CLONED;
+            start_(clone, func);
+        }
+    }
+    call_awaiter(const call_awaiter&) = delete;
+    ~call_awaiter() { if (h) h.destroy(); }
+
+    bool await_ready() noexcept {
+        return !h && !(turtle->iflags & NOCTT_FLAG_WAITING);
+    }
+    std::coroutine_handle<> await_suspend(rule::handle caller) noexcept {
+        if (!h) return std::noop_coroutine(); // Wait for the clone.
+        h.promise().parent = caller;
+        turtle->data = h.address();
+        return h;
+    }
+    void await_resume() noexcept {
+        if (!h) return;
+        h.destroy();
+        h = nullptr;
+        // Return from the call, unless the scheduler already did it.
+        if (turtle->depth == depth) noctt_kill(turtle);
+    }
+};
+
+template <class... Ops>
+call_awaiter call(noctt_turtle_t *turtle, rule_func_t func, Ops... ops)
+{
+    const float ops_[] = {0, (float)ops...};
+    return call_awaiter(turtle, func, sizeof...(ops), ops_ + 1);
+}
+
+// Same as SPAWN(func, ops...).  Return the new turtle, or NULL if it could
+// not be created.
+template <class... Ops>
+noctt_turtle_t *spawn(noctt_turtle_t *turtle, rule_func_t func, Ops... ops)
+{
+    const float ops_[] = {0, (float)ops...};
+    noctt_turtle_t *ret = noctt_clone(turtle, 0, sizeof...(ops), ops_ + 1);
+    if (!ret) return NULL;
+    ret->iflags &= ~NOCTT_FLAG_JUST_CLONED;
+    start_(ret, func);
+    return ret;
+}
+
+// co_await join(turtle) does the same as JOIN().
+struct join_awaiter {
+    bool ready;
+    bool await_ready() noexcept { return ready; }
+    void await_suspend(std::coroutine_handle<>) noexcept {}
+    void await_resume() noexcept {}
+};
+
+static inline join_awaiter join(noctt_turtle_t *turtle)
+{
+    return join_awaiter{!noctt_join(turtle)};
+}
+
+static inline noctt_prog_t *prog_create(rule_func_t func, int nb, int seed,
+                                        float rect[16], float pixel_size)
+{
+    noctt_prog_t *prog;
+    prog = noctt_prog_create(rule_trampoline_, nb, seed, rect, pixel_size);
+    start_(&prog->turtles[0], func);
+    return prog;
+}
+
+static inline void prog_delete(noctt_prog_t *prog)
+{
+    pool *p = (pool*)prog->coro_pool;
+    noctt_prog_delete(prog);
+    delete p;
+}
+
+}
+
+#endif // _NOC_TURTLE_CORO_H_
@@ -0,0 +1,141 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "noc_turtle_pipe.h"
+
+struct noctt_pipe {
+    noctt_prog_t    *prog;
+    int             size;       // Always a power of two.
+    noctt_batch_t   *batches;
+    // Number of batches published and released so far.  head is only
+    // written by the generation thread, and tail by the render thread.
+    unsigned int    head;
+    unsigned int    tail;
+    bool            done;       // The program is finished.
+    bool            quit;
+    pthread_t       thread;
+    // Only used when the ring is full, to wait for a release.
+    pthread_mutex_t lock;
+    pthread_cond_t  release_cond;
+};
+
+// Hand the program batch over to the render thread: we swap it with the
+// next batch of the ring, that was already released, so that the program
+// reuses its memory for the next iteration.
+static void publish(const noctt_batch_t *batch, void *user_data)
+{
+    noctt_pipe_t *pipe = (noctt_pipe_t*)user_data;
+    const unsigned int head = pipe->head;
+    noctt_batch_t *dst, tmp;
+
+    assert(batch == &pipe->prog->batch);
+    if (head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) >=
+            (unsigned int)pipe->size) {
+        pthread_mutex_lock(&pipe->lock);
+        while (head - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) >=
+                    (unsigned int)pipe->size && !pipe->quit)
+            pthread_cond_wait(&pipe->release_cond, &pipe->lock);
+        pthread_mutex_unlock(&pipe->lock);
+        if (__atomic_load_n(&pipe->quit, __ATOMIC_RELAXED)) return;
+    }
+    dst = &pipe->batches[head & (pipe->size - 1)];
+    tmp = *dst;
+    *dst = pipe->prog->batch;
+    pipe->prog->batch = tmp;
+    __atomic_store_n(&pipe->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *generate(void *arg)
+{
+    noctt_pipe_t *pipe = (noctt_pipe_t*)arg;
+    while (pipe->prog->active &&
+            !__atomic_load_n(&pipe->quit, __ATOMIC_RELAXED)) {
+        noctt_prog_iter(pipe->prog);
+    }
+    __atomic_store_n(&pipe->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+noctt_pipe_t *noctt_pipe_create(noctt_prog_t *prog, int size)
+{
+    noctt_pipe_t *pipe = (noctt_pipe_t*)calloc(1, sizeof(*pipe));
+    pipe->prog = prog;
+    // Round up to a power of two, so that the indices stay right when
+    // head and tail wrap around.
+    pipe->size = 1;
+    while (pipe->size < size) pipe->size *= 2;
+    pipe->batches = (noctt_batch_t*)calloc(pipe->size,
+                                           sizeof(*pipe->batches));
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->release_cond, NULL);
+    prog->batch_callback = publish;
+    prog->render_callback_data = pipe;
+    pthread_create(&pipe->thread, NULL, generate, pipe);
+    return pipe;
+}
+
+void noctt_pipe_delete(noctt_pipe_t *pipe)
+{
+    int i;
+    pthread_mutex_lock(&pipe->lock);
+    __atomic_store_n(&pipe->quit, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pipe->release_cond);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->thread, NULL);
+    for (i = 0; i < pipe->size; i++)
+        noctt_batch_release(&pipe->batches[i]);
+    pipe->prog->batch_callback = NULL;
+    pipe->prog->render_callback_data = NULL;
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->release_cond);
+    free(pipe->batches);
+    free(pipe);
+}
+
+const noctt_batch_t *noctt_pipe_acquire(noctt_pipe_t *pipe)
+{
+    const unsigned int tail = pipe->tail;
+    if (__atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+    return &pipe->batches[tail & (pipe->size - 1)];
+}
+
+void noctt_pipe_release(noctt_pipe_t *pipe)
+{
+    // Once per frame, so the lock is cheap.  It makes sure the generation
+    // thread can't miss the signal if it is about to wait.
+    pthread_mutex_lock(&pipe->lock);
+    __atomic_store_n(&pipe->tail, pipe->tail + 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&pipe->release_cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+bool noctt_pipe_done(noctt_pipe_t *pipe)
+{
+    return __atomic_load_n(&pipe->done, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == pipe->tail;
+}
@@ -0,0 +1,74 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Run a noc_turtle program in its own thread.
+ *
+ * The generation thread calls noctt_prog_iter in a loop, and publishes the
+ * primitives of each iteration into a ring of batches.  The render thread
+ * gets them in order, so it can render a frame while the next ones are
+ * generated.  The batches are handed over without copy: the program batch
+ * is swapped with a released batch of the ring.  When the ring is full the
+ * generation thread waits for a release.
+ *
+ *     prog = noctt_prog_create(my_rule, 256, 0, mat, 1);
+ *     pipe = noctt_pipe_create(prog, 2);
+ *     // For each frame:
+ *     batch = noctt_pipe_acquire(pipe);
+ *     if (batch) {
+ *         render(batch);
+ *         noctt_pipe_release(pipe);
+ *     }
+ *     ...
+ *     noctt_pipe_delete(pipe);
+ *     noctt_prog_delete(prog);
+ *
+ * The program batch_callback is set by the pipe, and we should not touch
+ * the program until the pipe is deleted.  noctt_pipe_acquire never blocks,
+ * and the ring only takes a lock in noctt_pipe_release, to wake up the
+ * generation thread.  This file uses pthread, so we have to compile
+ * noc_turtle_pipe.c along with noc_turtle.c and link with -lpthread.
+ */
+
+#ifndef _NOC_TURTLE_PIPE_H_
+#define _NOC_TURTLE_PIPE_H_
+
+#include "noc_turtle.h"
+
+typedef struct noctt_pipe noctt_pipe_t;
+
+// Start the generation thread, with a ring of size batches, rounded up to
+// a power of two.
+noctt_pipe_t *noctt_pipe_create(noctt_prog_t *prog, int size);
+// Stop the generation thread.
+void noctt_pipe_delete(noctt_pipe_t *pipe);
+// Return the primitives of the next iteration, or NULL if they are not
+// ready yet.  The batch has to be released with noctt_pipe_release before
+// the next call.
+const noctt_batch_t *noctt_pipe_acquire(noctt_pipe_t *pipe);
+void noctt_pipe_release(noctt_pipe_t *pipe);
+// Return true once the program is done and all the batches have been
+// released.
+bool noctt_pipe_done(noctt_pipe_t *pipe);
+
+#endif // _NOC_TURTLE_PIPE_H_
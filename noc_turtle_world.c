@@ -0,0 +1,311 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "noc_turtle_world.h"
+
+// Max number of turtles of the tiles programs.
+#define TILE_NB_TURTLES 256
+
+enum {
+    TILE_EMPTY = 0,
+    TILE_PENDING,   // Waiting for the worker.
+    TILE_RUNNING,   // Being generated by the worker.
+    TILE_READY,
+};
+
+typedef struct {
+    noctt_tile_t    tile;
+    int             state;
+    bool            wanted;     // Around the current view.
+    float           dist;       // Distance to the view center, in tiles.
+    unsigned int    last_used;
+} slot_t;
+
+struct noctt_world {
+    noctt_rule_func_t       rule;
+    int                     seed;
+    float                   tile_size;
+    float                   pixel_size;
+    noctt_tile_setup_func_t setup;
+    void                    *setup_data;
+    int                     nb;
+    slot_t                  *slots;
+    unsigned int            clock;      // Used for the LRU.
+    // The slots are shared with the worker thread, and protected by lock.
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          work_cond;  // Some tiles are pending.
+    pthread_cond_t          done_cond;  // A tile is ready.
+    bool                    quit;
+};
+
+static int tile_seed(int seed, int x, int y)
+{
+    const int v[3] = {seed, x, y};
+    const unsigned char *p = (const unsigned char*)v;
+    unsigned int h = 2166136261U;
+    int i;
+    for (i = 0; i < (int)sizeof(v); i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h & 0x7fffffff;
+}
+
+static void tile_batch(const noctt_batch_t *batch, void *user_data)
+{
+    noctt_batch_t *out = (noctt_batch_t*)user_data;
+    const noctt_prim_t *prim = NULL;
+    while ((prim = noctt_batch_next(batch, prim)))
+        noctt_batch_add(out, prim->n, prim->poly, prim->color, prim->flags);
+}
+
+static void generate(const noctt_world_t *world, int x, int y,
+                     noctt_batch_t *out)
+{
+    const float s = world->tile_size;
+    float mat[16] = {s, 0, 0, 0,
+                     0, s, 0, 0,
+                     0, 0, 1, 0,
+                     (x + 0.5f) * s, (y + 0.5f) * s, 0, 1};
+    noctt_prog_t *prog;
+    prog = noctt_prog_create(world->rule, TILE_NB_TURTLES,
+                             tile_seed(world->seed, x, y), mat,
+                             world->pixel_size);
+    prog->clip_rect[0] = prog->cull_rect[0] = x * s;
+    prog->clip_rect[1] = prog->cull_rect[1] = y * s;
+    prog->clip_rect[2] = prog->cull_rect[2] = s;
+    prog->clip_rect[3] = prog->cull_rect[3] = s;
+    prog->batch_callback = tile_batch;
+    prog->render_callback_data = out;
+    if (world->setup) world->setup(prog, x, y, world->setup_data);
+    noctt_prog_run(prog);
+    noctt_prog_delete(prog);
+}
+
+// Return the pending tile closest to the view center.
+static slot_t *next_pending(noctt_world_t *world)
+{
+    int i;
+    slot_t *ret = NULL;
+    for (i = 0; i < world->nb; i++) {
+        if (world->slots[i].state != TILE_PENDING) continue;
+        if (!ret || world->slots[i].dist < ret->dist) ret = &world->slots[i];
+    }
+    return ret;
+}
+
+static void *worker(void *arg)
+{
+    noctt_world_t *world = (noctt_world_t*)arg;
+    noctt_batch_t batch;
+    slot_t *slot;
+    int x, y;
+
+    pthread_mutex_lock(&world->lock);
+    while (!world->quit) {
+        slot = next_pending(world);
+        if (!slot) {
+            pthread_cond_wait(&world->work_cond, &world->lock);
+            continue;
+        }
+        // The main thread never touches the running slots, so we can
+        // release the lock while we generate.
+        slot->state = TILE_RUNNING;
+        x = slot->tile.x;
+        y = slot->tile.y;
+        pthread_mutex_unlock(&world->lock);
+        memset(&batch, 0, sizeof(batch));
+        generate(world, x, y, &batch);
+        pthread_mutex_lock(&world->lock);
+        slot->tile.batch = batch;
+        slot->state = TILE_READY;
+        pthread_cond_broadcast(&world->done_cond);
+    }
+    pthread_mutex_unlock(&world->lock);
+    return NULL;
+}
+
+noctt_world_t *noctt_world_create(noctt_rule_func_t rule, int seed,
+                                  float tile_size, int cache_size,
+                                  float pixel_size)
+{
+    noctt_world_t *world = (noctt_world_t*)calloc(1, sizeof(*world));
+    world->rule = rule;
+    world->seed = seed;
+    world->tile_size = tile_size;
+    world->pixel_size = pixel_size;
+    world->nb = cache_size;
+    world->slots = (slot_t*)calloc(cache_size, sizeof(*world->slots));
+    pthread_mutex_init(&world->lock, NULL);
+    pthread_cond_init(&world->work_cond, NULL);
+    pthread_cond_init(&world->done_cond, NULL);
+    pthread_create(&world->thread, NULL, worker, world);
+    return world;
+}
+
+void noctt_world_delete(noctt_world_t *world)
+{
+    int i;
+    pthread_mutex_lock(&world->lock);
+    world->quit = true;
+    pthread_cond_signal(&world->work_cond);
+    pthread_mutex_unlock(&world->lock);
+    pthread_join(world->thread, NULL);
+    for (i = 0; i < world->nb; i++)
+        noctt_batch_release(&world->slots[i].tile.batch);
+    pthread_mutex_destroy(&world->lock);
+    pthread_cond_destroy(&world->work_cond);
+    pthread_cond_destroy(&world->done_cond);
+    free(world->slots);
+    free(world);
+}
+
+void noctt_world_set_setup(noctt_world_t *world,
+                           noctt_tile_setup_func_t func, void *user_data)
+{
+    world->setup = func;
+    world->setup_data = user_data;
+}
+
+static slot_t *find_slot(noctt_world_t *world, int x, int y)
+{
+    int i;
+    slot_t *slot;
+    for (i = 0; i < world->nb; i++) {
+        slot = &world->slots[i];
+        if (slot->state != TILE_EMPTY && slot->tile.x == x && slot->tile.y == y)
+            return slot;
+    }
+    return NULL;
+}
+
+// Return an empty slot, dropping the least recently used tile not around
+// the view if needed.
+static slot_t *free_slot(noctt_world_t *world)
+{
+    int i;
+    slot_t *slot, *ret = NULL;
+    for (i = 0; i < world->nb; i++) {
+        slot = &world->slots[i];
+        if (slot->state == TILE_EMPTY) return slot;
+        if (slot->wanted || slot->state == TILE_RUNNING) continue;
+        if (!ret || slot->last_used < ret->last_used) ret = slot;
+    }
+    if (ret) {
+        noctt_batch_release(&ret->tile.batch);
+        ret->state = TILE_EMPTY;
+    }
+    return ret;
+}
+
+typedef struct {
+    int     x, y;
+    float   dist;
+} tile_pos_t;
+
+static int tile_pos_cmp(const void *a, const void *b)
+{
+    const tile_pos_t *p = (const tile_pos_t*)a, *q = (const tile_pos_t*)b;
+    return p->dist < q->dist ? -1 : p->dist > q->dist ? +1 : 0;
+}
+
+void noctt_world_set_view(noctt_world_t *world, const float rect[4])
+{
+    const float s = world->tile_size;
+    const int x0 = floor(rect[0] / s) - 1;
+    const int y0 = floor(rect[1] / s) - 1;
+    const int x1 = floor((rect[0] + rect[2]) / s) + 1;
+    const int y1 = floor((rect[1] + rect[3]) / s) + 1;
+    const float cx = (rect[0] + rect[2] / 2) / s - 0.5;
+    const float cy = (rect[1] + rect[3] / 2) / s - 0.5;
+    int i, x, y, nb = 0;
+    tile_pos_t *tiles;
+    slot_t *slot;
+
+    tiles = (tile_pos_t*)malloc((x1 - x0 + 1) * (y1 - y0 + 1) *
+                                sizeof(*tiles));
+    for (y = y0; y <= y1; y++)
+    for (x = x0; x <= x1; x++) {
+        tiles[nb].x = x;
+        tiles[nb].y = y;
+        tiles[nb].dist = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+        nb++;
+    }
+    qsort(tiles, nb, sizeof(*tiles), tile_pos_cmp);
+
+    pthread_mutex_lock(&world->lock);
+    for (i = 0; i < world->nb; i++) world->slots[i].wanted = false;
+    for (i = 0; i < nb; i++) {
+        slot = find_slot(world, tiles[i].x, tiles[i].y);
+        if (!slot) {
+            slot = free_slot(world);
+            if (!slot) break; // The cache is too small.
+            slot->tile.x = tiles[i].x;
+            slot->tile.y = tiles[i].y;
+            slot->state = TILE_PENDING;
+        }
+        slot->wanted = true;
+        slot->dist = tiles[i].dist;
+        slot->last_used = ++world->clock;
+    }
+    // No need to generate the tiles that went out of the view.
+    for (i = 0; i < world->nb; i++) {
+        slot = &world->slots[i];
+        if (slot->state == TILE_PENDING && !slot->wanted)
+            slot->state = TILE_EMPTY;
+    }
+    pthread_cond_signal(&world->work_cond);
+    pthread_mutex_unlock(&world->lock);
+    free(tiles);
+}
+
+const noctt_tile_t *noctt_world_get_tile(noctt_world_t *world, int x, int y)
+{
+    slot_t *slot;
+    const noctt_tile_t *ret = NULL;
+    pthread_mutex_lock(&world->lock);
+    slot = find_slot(world, x, y);
+    if (slot && slot->state == TILE_READY) {
+        slot->last_used = ++world->clock;
+        ret = &slot->tile;
+    }
+    pthread_mutex_unlock(&world->lock);
+    return ret;
+}
+
+void noctt_world_wait(noctt_world_t *world)
+{
+    int i;
+    pthread_mutex_lock(&world->lock);
+    for (i = 0; i < world->nb; i++) {
+        while (world->slots[i].wanted &&
+               world->slots[i].state != TILE_READY)
+            pthread_cond_wait(&world->done_cond, &world->lock);
+    }
+    pthread_mutex_unlock(&world->lock);
+}
@@ -0,0 +1,92 @@
+/* noc_turtle library
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Tiled world generation for noc_turtle.
+ *
+ * The world is split into square tiles, and each tile is rendered by its
+ * own program, whose seed only depends on the world seed and the tile
+ * coordinates, so a tile always gets the same content.  In the rule, the
+ * tile is the unit square centered on the turtle, and the primitives are
+ * clipped to it.
+ *
+ * A background thread generates the tiles around the current view into a
+ * cache of fixed size.  When we need room, the least recently used tiles
+ * that are not around the view get dropped, so we can scroll forever with
+ * a constant memory.
+ *
+ *     world = noctt_world_create(my_rule, 0, 256, 64, 1);
+ *     // For each frame:
+ *     noctt_world_set_view(world, view_rect);  // (x, y, w, h)
+ *     for (each visible tile x, y) {
+ *         tile = noctt_world_get_tile(world, x, y);
+ *         if (tile) render(&tile->batch);
+ *     }
+ *     ...
+ *     noctt_world_delete(world);
+ *
+ * The tile (x, y) covers the world area from (x * tile_size, y * tile_size)
+ * to ((x + 1) * tile_size, (y + 1) * tile_size).  The tiles rules are run
+ * with noctt_prog_run, so they have to end.
+ *
+ * All the functions have to be called from the same thread.  This file
+ * uses pthread, so we have to compile noc_turtle_world.c along with
+ * noc_turtle.c and link with -lpthread.
+ */
+
+#ifndef _NOC_TURTLE_WORLD_H_
+#define _NOC_TURTLE_WORLD_H_
+
+#include "noc_turtle.h"
+
+typedef struct noctt_world noctt_world_t;
+
+typedef struct {
+    int             x, y;       // Tile coordinates.
+    noctt_batch_t   batch;      // The primitives of the tile.
+} noctt_tile_t;
+
+// Called on each tile program before it runs, from the worker thread.  Can
+// be used to set the program rules, tess_tolerance, etc.
+typedef void (*noctt_tile_setup_func_t)(noctt_prog_t *prog, int x, int y,
+                                        void *user_data);
+
+// cache_size is the max number of tiles kept in memory.  It should be
+// bigger than the number of tiles around the view.
+noctt_world_t *noctt_world_create(noctt_rule_func_t rule, int seed,
+                                  float tile_size, int cache_size,
+                                  float pixel_size);
+void noctt_world_delete(noctt_world_t *world);
+// Must be called before the first call to noctt_world_set_view.
+void noctt_world_set_setup(noctt_world_t *world,
+                           noctt_tile_setup_func_t func, void *user_data);
+// Set the visible (x, y, w, h) area.  The tiles it covers, plus a margin of
+// one tile, get generated, the closest to the center first.
+void noctt_world_set_view(noctt_world_t *world, const float rect[4]);
+// Return a tile if it is ready, NULL otherwise.  The tile stays valid until
+// the next call to noctt_world_set_view.
+const noctt_tile_t *noctt_world_get_tile(noctt_world_t *world, int x, int y);
+// Wait until all the tiles around the view are ready.
+void noctt_world_wait(noctt_world_t *world);
+
+#endif // _NOC_TURTLE_WORLD_H_
@@ -0,0 +1,228 @@
+/* noc turtle benchmark.
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Headless benchmark of the noc_turtle library.
+ *
+ * Run some of the demo rules with fixed seeds and a render callback that
+ * only counts the primitives, and print one JSON object per rule:
+ *
+ *     ./bench_turtle [nb_runs]
+ *
+ * The malloc calls made by the library are counted by linking with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (see the Makefile).
+ *
+ * The programs run with a max_turtles budget, so that a rule that grows
+ * more than expected degrades instead of filling the pool.  If a scene gets
+ * degraded, or if a clone still fails because the pool is full, the
+ * benchmark fails: the numbers would not measure the whole scene.
+ */
+
+#include "noc_turtle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// The benchmark doesn't render any text.
+static void font_draw_text(float x, float y, const char *msg) {}
+
+// The rules of turtle_rules.h that we don't run.
+static void demo1(noctt_turtle_t *turtle) __attribute__((unused));
+static void demo_sun(noctt_turtle_t *turtle) __attribute__((unused));
+static void shapes_rule(noctt_turtle_t *turtle) __attribute__((unused));
+static void stencil_rule(noctt_turtle_t *turtle) __attribute__((unused));
+static void colors_rule(noctt_turtle_t *turtle) __attribute__((unused));
+
+#include "turtle_rules.h"
+
+#undef NOC_TURTLE_UNDEF_NAMES
+#define NOC_TURTLE_DEFINE_NAMES
+#include "noc_turtle.h"
+
+// A prop rendered 50 times, with CALL and with CALL_MEMO, to measure the
+// gain of the memoization.
+static void prop(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(40, R, 9, S, 0.97) {
+        SQUARE(X, 0.5, S, 0.2, LIGHT, FRAND(-0.1, 0.1));
+    }
+    CALL(prop, S, 0.5, X, 1);
+    END
+}
+
+static void props(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(50, X, 0.02) {
+        CALL(prop, S, 0.05);
+    }
+    END
+}
+
+static void props_memo(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(50, X, 0.02) {
+        CALL_MEMO(prop, 1, S, 0.05);
+    }
+    END
+}
+
+#define NOC_TURTLE_UNDEF_NAMES
+#include "noc_turtle.h"
+
+// Stop the programs that never end after this many iterations.
+#define MAX_ITER 10000
+// Number of turtles in the programs pools.
+#define POOL_SIZE 1024
+// Max number of turtles alive, see noctt_prog_t.max_turtles.  It has to
+// be lower than the pool size, so that the budget refuses the new turtles
+// before the pool gets full.
+#define MAX_TURTLES 1000
+
+static long nb_allocs = 0;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    nb_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    nb_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    nb_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+typedef struct {
+    long prims;
+    long verts;
+} counter_t;
+
+// The null sink: only count what we get.
+static void render_callback(int n, const noctt_vec3_t *poly,
+                            const float color[4], unsigned int flags,
+                            void *user_data)
+{
+    counter_t *counter = (counter_t*)user_data;
+    counter->prims++;
+    counter->verts += n;
+}
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static const struct {
+    const char          *name;
+    noctt_rule_func_t   rule;
+} RULES[] = {
+    // No modern: its branches multiply at each iteration until they get
+    // too small, so it can't complete without dropping turtles.
+    {"blowfish", blowfish_city_rule},
+    {"tree", tree_rule},
+    {"spiral", demo_spiral},
+    {"blowfish objs", blowfish_objs},
+    {"props", props},
+    {"props memo", props_memo},
+};
+
+// Return false if some clones failed, or if the scene got degraded.
+static bool bench(const char *name, noctt_rule_func_t rule, int nb_runs)
+{
+    float mat[16] = {640, 0,   0, 0,
+                     0,   480, 0, 0,
+                     0,   0,   1, 0,
+                     0,   0,   0, 1};
+    noctt_prog_t *prog;
+    counter_t counter = {0, 0};
+    long turtles = 0, iters = 0, allocs;
+    int seed, peak = 0, failures = 0, nb_degraded = 0;
+    double time = 0, t;
+
+    allocs = nb_allocs;
+    for (seed = 0; seed < nb_runs; seed++) {
+        t = get_time();
+        prog = noctt_prog_create(rule, POOL_SIZE, seed, mat, 1);
+        prog->render_callback = render_callback;
+        prog->render_callback_data = &counter;
+        prog->max_turtles = MAX_TURTLES;
+        while (prog->active && prog->iter < MAX_ITER)
+            noctt_prog_iter(prog);
+        if (prog->peak_active > peak) peak = prog->peak_active;
+        turtles += prog->total_turtles;
+        iters += prog->iter;
+        failures += prog->clone_failures;
+        nb_degraded += prog->degraded;
+        noctt_prog_delete(prog);
+        time += get_time() - t;
+    }
+    allocs = nb_allocs - allocs;
+    printf("{\"rule\": \"%s\", \"runs\": %d, \"iters\": %ld, "
+           "\"time\": %.6f, \"turtles_per_s\": %.0f, \"prims_per_s\": %.0f, "
+           "\"verts_per_s\": %.0f, \"peak_pool\": %d, \"pool_size\": %d, "
+           "\"degraded\": %s, \"clone_failures\": %d, "
+           "\"allocs_per_iter\": %.3f}\n",
+           name, nb_runs, iters, time, turtles / time, counter.prims / time,
+           counter.verts / time, peak, POOL_SIZE,
+           nb_degraded ? "true" : "false", failures, (double)allocs / iters);
+    if (failures)
+        fprintf(stderr, "ERROR: %s: %d clones failed, the pool is full\n",
+                name, failures);
+    if (nb_degraded)
+        fprintf(stderr, "ERROR: %s: %d runs got degraded by max_turtles\n",
+                name, nb_degraded);
+    return failures == 0 && nb_degraded == 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i, nb_runs = argc > 1 ? atoi(argv[1]) : 20;
+    bool ok = true;
+    for (i = 0; i < (int)(sizeof(RULES) / sizeof(RULES[0])); i++)
+        ok = bench(RULES[i].name, RULES[i].rule, nb_runs) && ok;
+    return ok ? 0 : 1;
+}
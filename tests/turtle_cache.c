@@ -0,0 +1,193 @@
+/* noc_turtle_cache test code.
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Record a program into a cache file, replay it and check that we get the
+ * same primitives.  Then check that truncated or corrupted files are
+ * rejected.
+ */
+
+#include "noc_turtle_cache.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NOC_TURTLE_DEFINE_NAMES
+#include "noc_turtle.h"
+
+#define PATH "test_turtle_cache.bin"
+#define RULE_ID 1
+#define SEED 3
+
+// Offsets in the file, see file_header_t and file_frame_t in
+// noc_turtle_cache.c.
+#define HEADER_SIZE 104
+#define HEADER_INDEX 96
+
+// Hash of all the primitives we get.
+typedef struct {
+    int         nb;
+    uint32_t    hash;
+} counter_t;
+
+static void hash(uint32_t *h, const void *data, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+        *h = (*h ^ ((const uint8_t*)data)[i]) * 16777619U;
+}
+
+static void render_callback(int n, const noctt_vec3_t *poly,
+                            const float color[4], unsigned int flags,
+                            void *user_data)
+{
+    counter_t *counter = (counter_t*)user_data;
+    counter->nb++;
+    hash(&counter->hash, &n, sizeof(n));
+    hash(&counter->hash, poly, n * sizeof(*poly));
+    hash(&counter->hash, color, 4 * sizeof(*color));
+    hash(&counter->hash, &flags, sizeof(flags));
+}
+
+// An animated rule, so that the file gets several frames.
+static void rule(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(20, R, 18, S, 0.95, LIGHT, 0.02) {
+        SQUARE(X, 0.5, S, 0.1, HUE, FRAND(0, 360));
+        CIRCLE(X, 0.3, S, 0.05);
+        YIELD();
+    }
+    END
+}
+
+static const float MAT[16] = {100, 0, 0, 0, 0, 100, 0, 0,
+                              0, 0, 1, 0, 0, 0, 0, 1};
+
+static void record(counter_t *counter)
+{
+    noctt_prog_t *prog;
+    noctt_cache_writer_t *writer;
+
+    prog = noctt_prog_create(rule, 64, SEED, (float*)MAT, 1);
+    prog->render_callback = render_callback;
+    prog->render_callback_data = counter;
+    writer = noctt_cache_record(prog, PATH, RULE_ID, SEED, MAT);
+    assert(writer);
+    while (prog->active) noctt_prog_iter(prog);
+    assert(noctt_cache_finish(writer));
+    noctt_prog_delete(prog);
+}
+
+static void replay(counter_t *counter)
+{
+    noctt_cache_t *cache;
+    int i;
+    cache = noctt_cache_open(PATH, RULE_ID, SEED, MAT, 1);
+    assert(cache);
+    assert(noctt_cache_nb_frames(cache) > 1);
+    for (i = 0; i < noctt_cache_nb_frames(cache); i++)
+        noctt_cache_replay(cache, i, NULL, render_callback, counter);
+    noctt_cache_close(cache);
+}
+
+static bool can_open(void)
+{
+    noctt_cache_t *cache = noctt_cache_open(PATH, RULE_ID, SEED, MAT, 1);
+    noctt_cache_close(cache);
+    return cache != NULL;
+}
+
+static void patch(long pos, const void *data, int size)
+{
+    FILE *file = fopen(PATH, "r+b");
+    assert(file);
+    fseek(file, pos, SEEK_SET);
+    fwrite(data, size, 1, file);
+    fclose(file);
+}
+
+static void read_at(long pos, void *data, int size)
+{
+    FILE *file = fopen(PATH, "rb");
+    assert(file);
+    fseek(file, pos, SEEK_SET);
+    assert(fread(data, size, 1, file) == 1);
+    fclose(file);
+}
+
+int main()
+{
+    counter_t recorded = {0, 2166136261U}, replayed = {0, 2166136261U};
+    int32_t n, bad_n;
+    uint64_t index, offset, bad_offset = UINT64_MAX - 7;
+    long size;
+    FILE *file;
+
+    // Round trip.
+    record(&recorded);
+    replay(&replayed);
+    assert(recorded.nb > 0);
+    assert(replayed.nb == recorded.nb);
+    assert(replayed.hash == recorded.hash);
+
+    // Wrong parameters.
+    assert(!noctt_cache_open(PATH, RULE_ID + 1, SEED, MAT, 1));
+    assert(!noctt_cache_open(PATH, RULE_ID, SEED + 1, MAT, 1));
+    assert(!noctt_cache_open(PATH, RULE_ID, SEED, MAT, 2));
+
+    // Corrupted number of vertices of the first primitive.
+    read_at(HEADER_SIZE, &n, sizeof(n));
+    bad_n = n + 1;
+    patch(HEADER_SIZE, &bad_n, sizeof(bad_n));
+    assert(!can_open());
+    bad_n = 1 << 30;
+    patch(HEADER_SIZE, &bad_n, sizeof(bad_n));
+    assert(!can_open());
+    patch(HEADER_SIZE, &n, sizeof(n));
+    assert(can_open());
+
+    // Corrupted offset of the first frame, that would wrap around.
+    read_at(HEADER_INDEX, &index, sizeof(index));
+    assert(index % 8 == 0);
+    read_at(index, &offset, sizeof(offset));
+    patch(index, &bad_offset, sizeof(bad_offset));
+    assert(!can_open());
+    patch(index, &offset, sizeof(offset));
+    assert(can_open());
+
+    // Truncated file.
+    file = fopen(PATH, "rb");
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+    assert(truncate(PATH, size - 8) == 0);
+    assert(!can_open());
+
+    unlink(PATH);
+    printf("All tests passed\n");
+    return 0;
+}
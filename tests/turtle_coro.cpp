@@ -0,0 +1,114 @@
+/* noc turtle coroutines example.
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * The tree demo of turtle.c written with the C++20 coroutine rules of
+ * noc_turtle_coro.h.  It runs without any window and prints the number of
+ * rendered primitives, first iteration by iteration, then with
+ * noctt_prog_run.
+ */
+
+#include "noc_turtle_coro.h"
+
+#include <stdio.h>
+
+#define NOC_TURTLE_DEFINE_NAMES
+#include "noc_turtle.h"
+
+static noctt::rule moon(noctt_turtle_t *turtle)
+{
+    CIRCLE(LIGHT, -0.5, G, 2);
+    for (int i = 0; i < 32; i++) {
+        TR(S, 0.95, LIGHT, 0.01);
+        CIRCLE();
+        co_yield 1;
+    }
+}
+
+static noctt::rule part(noctt_turtle_t *turtle)
+{
+    // vars[0] is copied into the spawned turtles, so that all the branches
+    // stop after 15 parts.
+    for (;;) {
+        RSQUARE(0, SX, 0.2, HUE, PM(0, 15));
+        RSQUARE(0, SX, 0.2, LIGHT, -0.4, G, 2, Z, -0.5);
+        if (++turtle->vars[0] == 15) {
+            TR(S, PM(1, 0.4));
+            CIRCLE(HUE, PM(0, 45));
+            CIRCLE(HUE, PM(0, 45), LIGHT, -0.4, G, 2, Z, -0.5);
+            co_return;
+        }
+        if (BRAND(0.3))
+            noctt::spawn(turtle, part, R, PM(0, 90), Y, 0.5);
+        co_yield 4;
+        TR(Y, 0.45, R, PM(0, 45), Y, 0.45, S, 0.9);
+    }
+}
+
+static noctt::rule tree(noctt_turtle_t *turtle)
+{
+    TR(HSL, 180, 0.5, 0.5);
+    SQUARE(LIGHT, 0.1, SAT, -0.5, Z, -1);
+    noctt::spawn(turtle, moon, X, 0.3, 0.3, SN, S, 0.2);
+    co_await noctt::call(turtle, part, Y, -0.5, SN, S, 0.1);
+    // Wait for the moon and the branches before the last square.
+    co_await noctt::join(turtle);
+    SQUARE(S, 0.1, LIGHT, -0.1);
+}
+
+#define NOC_TURTLE_UNDEF_NAMES
+#include "noc_turtle.h"
+
+static void render_callback(int n, const noctt_vec3_t *poly,
+                            const float color[4], unsigned int flags,
+                            void *user_data)
+{
+    (*(int*)user_data)++;
+}
+
+int main()
+{
+    float mat[16] = {640, 0,   0, 0,
+                     0,   480, 0, 0,
+                     0,   0,   1, 0,
+                     0,   0,   0, 1};
+    noctt_prog_t *prog;
+    int nb = 0;
+
+    prog = noctt::prog_create(tree, 256, 0, mat, 1);
+    prog->render_callback = render_callback;
+    prog->render_callback_data = &nb;
+    while (prog->active)
+        noctt_prog_iter(prog);
+    printf("iter: %d primitives in %d iterations\n", nb, prog->iter);
+    noctt::prog_delete(prog);
+
+    nb = 0;
+    prog = noctt::prog_create(tree, 256, 0, mat, 1);
+    prog->render_callback = render_callback;
+    prog->render_callback_data = &nb;
+    noctt_prog_run(prog);
+    printf("run: %d primitives\n", nb);
+    noctt::prog_delete(prog);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/* noc_turtle_pipe test code.
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Run an animated program through a pipe, with a fast and a slow render
+ * thread and different ring sizes, and check that we get the batches of
+ * every iteration in order, as if we had called noctt_prog_iter ourself.
+ */
+
+#include "noc_turtle_pipe.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define NOC_TURTLE_DEFINE_NAMES
+#include "noc_turtle.h"
+
+#define MAX_FRAMES 512
+
+static void rule(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(100, R, 3.6, S, 0.99) {
+        SQUARE(X, 0.5, S, 0.1, HUE, FRAND(0, 360));
+        if (BRAND(0.1)) SPAWN(rule, S, 0.5);
+        YIELD();
+    }
+    END
+}
+
+static uint32_t hash_batch(const noctt_batch_t *batch)
+{
+    const unsigned char *p = (const unsigned char*)batch->data;
+    uint32_t h = 2166136261U;
+    int i;
+    h = (h ^ batch->nb) * 16777619U;
+    for (i = 0; i < batch->size; i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+typedef struct {
+    int         nb;
+    uint32_t    hashes[MAX_FRAMES];
+} frames_t;
+
+static void batch_callback(const noctt_batch_t *batch, void *user_data)
+{
+    frames_t *frames = (frames_t*)user_data;
+    assert(frames->nb < MAX_FRAMES);
+    frames->hashes[frames->nb++] = hash_batch(batch);
+}
+
+static noctt_prog_t *create(void)
+{
+    float mat[16] = {100, 0, 0, 0, 0, 100, 0, 0,
+                     0, 0, 1, 0, 0, 0, 0, 1};
+    return noctt_prog_create(rule, 256, 7, mat, 1);
+}
+
+// Run the program through a pipe.  If slow is set, the render thread
+// sleeps a bit on some frames, so that the ring gets full.
+static void run_pipe(int size, bool slow, const frames_t *ref)
+{
+    const struct timespec wait = {0, 200000};
+    noctt_prog_t *prog = create();
+    noctt_pipe_t *pipe = noctt_pipe_create(prog, size);
+    const noctt_batch_t *batch;
+    int nb = 0;
+
+    while (!noctt_pipe_done(pipe)) {
+        batch = noctt_pipe_acquire(pipe);
+        if (!batch) continue;
+        assert(nb < ref->nb);
+        assert(hash_batch(batch) == ref->hashes[nb]);
+        nb++;
+        if (slow && nb % 8 == 0) nanosleep(&wait, NULL);
+        noctt_pipe_release(pipe);
+    }
+    assert(nb == ref->nb);
+    noctt_pipe_delete(pipe);
+    noctt_prog_delete(prog);
+}
+
+int main()
+{
+    frames_t ref = {0};
+    noctt_prog_t *prog;
+    noctt_pipe_t *pipe;
+
+    // Reference: the batches we get without the pipe.
+    prog = create();
+    prog->batch_callback = batch_callback;
+    prog->render_callback_data = &ref;
+    while (prog->active) noctt_prog_iter(prog);
+    noctt_prog_delete(prog);
+    assert(ref.nb > 100);
+
+    run_pipe(1, false, &ref);
+    run_pipe(1, true, &ref);
+    run_pipe(3, false, &ref);
+    run_pipe(3, true, &ref);
+    run_pipe(8, true, &ref);
+
+    // Delete the pipe while the generation thread waits on a full ring.
+    prog = create();
+    pipe = noctt_pipe_create(prog, 2);
+    while (!noctt_pipe_acquire(pipe)) {}
+    noctt_pipe_delete(pipe);
+    noctt_prog_delete(prog);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,473 @@
+/* noc_turtle test code.
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Headless tests of the noc_turtle scheduler.  Each test runs a small
+ * program and checks what got rendered, or the events logged by the rules.
+ */
+
+#include "noc_turtle.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NOC_TURTLE_DEFINE_NAMES
+#include "noc_turtle.h"
+
+// Events logged by the rules, with the iteration they happened at.
+static struct {
+    char    name;
+    int     iter;
+} events[64];
+static int nb_events = 0;
+
+static void log_event(noctt_turtle_t *turtle, char name)
+{
+    assert(nb_events < 64);
+    events[nb_events].name = name;
+    events[nb_events].iter = turtle->prog->iter;
+    nb_events++;
+}
+
+// Return the iteration of an event, or -1 if it didn't happen.
+static int event_iter(char name)
+{
+    int i;
+    for (i = 0; i < nb_events; i++)
+        if (events[i].name == name) return events[i].iter;
+    return -1;
+}
+
+static void render_callback(int n, const noctt_vec3_t *poly,
+                            const float color[4], unsigned int flags,
+                            void *user_data)
+{
+    (*(int*)user_data)++;
+}
+
+// Run a rule with noctt_prog_iter until it is done, and return the number
+// of iterations, or -1 if it didn't end.
+static int run(noctt_rule_func_t rule, int max_iter, int *nb_prims)
+{
+    float mat[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    noctt_prog_t *prog;
+    int ret;
+
+    nb_events = 0;
+    *nb_prims = 0;
+    prog = noctt_prog_create(rule, 256, 0, mat, 0.001);
+    prog->render_callback = render_callback;
+    prog->render_callback_data = nb_prims;
+    while (prog->active && prog->iter < max_iter)
+        noctt_prog_iter(prog);
+    ret = prog->active ? -1 : prog->iter;
+    noctt_prog_delete(prog);
+    return ret;
+}
+
+// #### JOIN across frames ####
+//
+// A child spawned inside a CALL outlives the call.  The caller then enters
+// a second call at the same depth, that spawns its own child and JOINs.
+// The JOIN has to wait for its own child only.
+
+static void sleeper(noctt_turtle_t *turtle)
+{
+    START
+    YIELD(5);
+    log_event(turtle, 's');
+    END
+}
+
+static void long_sleeper(noctt_turtle_t *turtle)
+{
+    START
+    YIELD(20);
+    log_event(turtle, 'l');
+    END
+}
+
+static void spawn_sleeper(noctt_turtle_t *turtle)
+{
+    START
+    SPAWN(sleeper);
+    END
+}
+
+// Joins after the sleeper of the first call is dead, with no child of its
+// own: must not wait.
+static void join_alone(noctt_turtle_t *turtle)
+{
+    START
+    YIELD(10);
+    JOIN();
+    log_event(turtle, 'j');
+    END
+}
+
+// Joins with a child of its own still alive: must wait for it.
+static void join_child(noctt_turtle_t *turtle)
+{
+    START
+    SPAWN(long_sleeper);
+    YIELD(10);
+    JOIN();
+    log_event(turtle, 'j');
+    END
+}
+
+static void call_join_alone(noctt_turtle_t *turtle)
+{
+    START
+    CALL(spawn_sleeper);
+    CALL(join_alone);
+    SQUARE();
+    END
+}
+
+static void call_join_child(noctt_turtle_t *turtle)
+{
+    START
+    CALL(spawn_sleeper);
+    CALL(join_child);
+    SQUARE();
+    END
+}
+
+static void test_join_across_frames(void)
+{
+    int nb_prims;
+    assert(run(call_join_alone, 100, &nb_prims) != -1);
+    assert(nb_prims == 1);
+    assert(event_iter('s') < event_iter('j'));
+
+    assert(run(call_join_child, 100, &nb_prims) != -1);
+    assert(nb_prims == 1);
+    assert(event_iter('s') != -1);
+    assert(event_iter('l') != -1);
+    assert(event_iter('l') <= event_iter('j'));
+}
+
+// #### Sleeping turtles ####
+//
+// Many turtles sleeping for different durations: each one has to wake up
+// exactly at the iteration it asked for, even though the sweeps skip it
+// while it sleeps.
+
+static int nb_naps = 0;
+
+#define NAPPER(n) \
+    static void napper_##n(noctt_turtle_t *turtle) \
+    { \
+        START \
+        YIELD(n); \
+        assert(turtle->prog->iter == 1 + n); \
+        YIELD(n); \
+        assert(turtle->prog->iter == 1 + 2 * n); \
+        nb_naps++; \
+        END \
+    }
+
+NAPPER(2)
+NAPPER(3)
+NAPPER(7)
+
+static void spawn_nappers(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(50) {
+        SPAWN(napper_2);
+        SPAWN(napper_7);
+        SPAWN(napper_3);
+    }
+    JOIN();
+    SQUARE();
+    END
+}
+
+static void test_sleepers(void)
+{
+    int nb_prims;
+    nb_naps = 0;
+    assert(run(spawn_nappers, 100, &nb_prims) != -1);
+    assert(nb_naps == 150);
+    assert(nb_prims == 1);
+}
+
+// #### Scale scheduler ####
+//
+// With a budget too small for all the turtles, the biggest ones run first.
+// Otherwise they run in pool order.
+
+static float sizes[16];
+static int nb_sizes = 0;
+
+static void size_callback(int n, const noctt_vec3_t *poly,
+                          const float color[4], unsigned int flags,
+                          void *user_data)
+{
+    int i;
+    float size = 0;
+    for (i = 0; i < n; i++)
+        size = fmax(size, fabs(poly[i].x));
+    assert(nb_sizes < 16);
+    sizes[nb_sizes++] = size;
+}
+
+static void square(noctt_turtle_t *turtle)
+{
+    START
+    YIELD(5);
+    SQUARE();
+    END
+}
+
+// Spawn squares of increasing size, so that the pool order is the
+// smallest first.  They all wake up at the same iteration.
+static void spawn_squares(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(8, S, 1.5) {
+        SPAWN(square);
+    }
+    END
+}
+
+static void run_scale(int budget)
+{
+    float mat[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    noctt_prog_t *prog;
+
+    nb_sizes = 0;
+    prog = noctt_prog_create(spawn_squares, 256, 0, mat, 0.001);
+    prog->sched = NOCTT_SCHED_SCALE;
+    prog->render_callback = size_callback;
+    noctt_prog_iter(prog);
+    prog->iter_budget = budget;
+    while (prog->active && prog->iter < 100)
+        noctt_prog_iter(prog);
+    assert(!prog->active);
+    noctt_prog_delete(prog);
+    assert(nb_sizes == 8);
+}
+
+static void test_sched_scale(void)
+{
+    int i;
+    // The 4 biggest first, then the others fit in the budget.
+    run_scale(4);
+    for (i = 1; i < 4; i++)
+        assert(sizes[i] < sizes[i - 1]);
+    for (i = 4; i < 8; i++)
+        assert(sizes[i] < sizes[3]);
+    run_scale(8);
+    for (i = 1; i < 8; i++)
+        assert(sizes[i] > sizes[i - 1]);
+    run_scale(0);
+    for (i = 1; i < 8; i++)
+        assert(sizes[i] > sizes[i - 1]);
+}
+
+// #### CALL_MEMO ####
+//
+// A memoized call renders the same thing as a CALL, and leaves the random
+// generator of the caller in the same state.  The calls that can't be
+// memoized (rule that doesn't end in time, or cull rectangle) fall back to
+// a normal CALL.
+
+static unsigned long rand_after;
+
+static void dot(noctt_turtle_t *turtle)
+{
+    START
+    SQUARE(S, 0.1);
+    END
+}
+
+static void dots(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(10, X, 1) {
+        SPAWN(dot);
+    }
+    END
+}
+
+static void call_dots(noctt_turtle_t *turtle)
+{
+    START
+    CALL(dots);
+    rand_after = turtle->rand_next;
+    END
+}
+
+static void memo_dots(noctt_turtle_t *turtle)
+{
+    START
+    CALL_MEMO(dots, 1);
+    rand_after = turtle->rand_next;
+    END
+}
+
+static void long_rule(noctt_turtle_t *turtle)
+{
+    START
+    LOOP(1100) {
+        YIELD();
+    }
+    SQUARE();
+    END
+}
+
+static void memo_long(noctt_turtle_t *turtle)
+{
+    START
+    CALL_MEMO(long_rule, 1);
+    SQUARE();
+    END
+}
+
+// Run a rule with dot culled if it is not in the [-0.5, 4.5] x range.
+static int run_culled(noctt_rule_func_t rule)
+{
+    float mat[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    const float rect[4] = {-0.5, -0.5, 5, 1};
+    const noctt_rule_t rules[] = {{dot, "dot", 0.1}};
+    noctt_prog_t *prog;
+    int nb_prims = 0;
+
+    prog = noctt_prog_create(rule, 256, 0, mat, 0.001);
+    noctt_prog_set_rules(prog, rules, 1);
+    memcpy(prog->cull_rect, rect, sizeof(rect));
+    prog->render_callback = render_callback;
+    prog->render_callback_data = &nb_prims;
+    while (prog->active && prog->iter < 100)
+        noctt_prog_iter(prog);
+    assert(!prog->active);
+    noctt_prog_delete(prog);
+    return nb_prims;
+}
+
+static void test_call_memo(void)
+{
+    int nb_prims;
+    unsigned long call_rand;
+
+    assert(run(call_dots, 100, &nb_prims) != -1);
+    assert(nb_prims == 10);
+    call_rand = rand_after;
+    assert(run(memo_dots, 100, &nb_prims) != -1);
+    assert(nb_prims == 10);
+    assert(rand_after == call_rand);
+
+    assert(run(memo_long, 2000, &nb_prims) > 1100);
+    assert(nb_prims == 2);
+
+    assert(run_culled(call_dots) == 5);
+    assert(run_culled(memo_dots) == 5);
+}
+
+// #### merge_quads ####
+//
+// The squares of a same color run get merged even if they are not
+// consecutive in the batch, but not across a different color.
+
+static int batch_nb;
+static float batch_box[4];
+
+static void batch_callback(const noctt_batch_t *batch, void *user_data)
+{
+    const noctt_prim_t *prim = NULL;
+    int i;
+    if (!batch->nb) return;
+    batch_nb = batch->nb;
+    prim = noctt_batch_next(batch, prim);
+    batch_box[0] = batch_box[1] = +INFINITY;
+    batch_box[2] = batch_box[3] = -INFINITY;
+    for (i = 0; i < prim->n; i++) {
+        batch_box[0] = fmin(batch_box[0], prim->poly[i].x);
+        batch_box[1] = fmin(batch_box[1], prim->poly[i].y);
+        batch_box[2] = fmax(batch_box[2], prim->poly[i].x);
+        batch_box[3] = fmax(batch_box[3], prim->poly[i].y);
+    }
+}
+
+// A 2x2 grid where no two consecutive squares share an edge.
+static void grid(noctt_turtle_t *turtle)
+{
+    START
+    SQUARE();
+    SQUARE(X, 1, Y, 1);
+    SQUARE(X, 1);
+    SQUARE(Y, 1);
+    END
+}
+
+// Two squares that share an edge, with an other color between them.
+static void two_colors(noctt_turtle_t *turtle)
+{
+    START
+    SQUARE();
+    SQUARE(X, 5, LIGHT, 0.5);
+    SQUARE(X, 1);
+    END
+}
+
+static void run_batch(noctt_rule_func_t rule)
+{
+    float mat[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    noctt_prog_t *prog;
+
+    batch_nb = 0;
+    prog = noctt_prog_create(rule, 256, 0, mat, 0.001);
+    prog->batch_callback = batch_callback;
+    prog->merge_quads = true;
+    while (prog->active && prog->iter < 100)
+        noctt_prog_iter(prog);
+    noctt_prog_delete(prog);
+}
+
+static void test_merge_quads(void)
+{
+    run_batch(grid);
+    assert(batch_nb == 1);
+    assert(fabs(batch_box[0] + 0.5) < 0.001);
+    assert(fabs(batch_box[1] + 0.5) < 0.001);
+    assert(fabs(batch_box[2] - 1.5) < 0.001);
+    assert(fabs(batch_box[3] - 1.5) < 0.001);
+    run_batch(two_colors);
+    assert(batch_nb == 3);
+}
+
+int main()
+{
+    test_join_across_frames();
+    test_sleepers();
+    test_sched_scale();
+    test_call_memo();
+    test_merge_quads();
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* noc_turtle_world test code.
+ *
+ * Copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Headless test of the tiled world: request the tiles around a view, wait
+ * for the worker thread to generate them, and check their content.  Then
+ * scroll away and back, so that the cache has to drop the old tiles and
+ * generate them again.
+ */
+
+#include "noc_turtle_world.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define NOC_TURTLE_DEFINE_NAMES
+#include "noc_turtle.h"
+
+#define TILE_SIZE 100.0f
+#define CACHE_SIZE 32
+
+static int nb_setups = 0;
+
+static void rule(noctt_turtle_t *turtle)
+{
+    START
+    SQUARE(LIGHT, 0.5);
+    LOOP(10, R, 36) {
+        CIRCLE(X, FRAND(0, 0.8), S, 0.1, HUE, FRAND(0, 360));
+    }
+    END
+}
+
+static void setup(noctt_prog_t *prog, int x, int y, void *user_data)
+{
+    prog->tess_tolerance = 0.5;
+    (*(int*)user_data)++;
+}
+
+// Check that all the primitives of a tile are inside it, and return the
+// hash of the tile content.
+static uint32_t check_tile(const noctt_tile_t *tile)
+{
+    const noctt_prim_t *prim = NULL;
+    const unsigned char *p;
+    uint32_t h = 2166136261U;
+    int i;
+
+    assert(tile->batch.nb > 1);
+    while ((prim = noctt_batch_next(&tile->batch, prim))) {
+        for (i = 0; i < prim->n; i++) {
+            assert(prim->poly[i].x >= tile->x * TILE_SIZE - 0.01);
+            assert(prim->poly[i].x <= (tile->x + 1) * TILE_SIZE + 0.01);
+            assert(prim->poly[i].y >= tile->y * TILE_SIZE - 0.01);
+            assert(prim->poly[i].y <= (tile->y + 1) * TILE_SIZE + 0.01);
+        }
+    }
+    p = (const unsigned char*)tile->batch.data;
+    for (i = 0; i < tile->batch.size; i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+// Set the view to the 2x2 tiles starting at (x, y), wait, and check all
+// the tiles around.  Return the hash of the tile (x, y).
+static uint32_t show(noctt_world_t *world, int x, int y)
+{
+    const float rect[4] = {x * TILE_SIZE + 1, y * TILE_SIZE + 1,
+                           2 * TILE_SIZE - 2, 2 * TILE_SIZE - 2};
+    const noctt_tile_t *tile;
+    uint32_t ret = 0;
+    int i, j;
+
+    noctt_world_set_view(world, rect);
+    noctt_world_wait(world);
+    // The view plus a margin of one tile.
+    for (j = y - 1; j <= y + 2; j++)
+    for (i = x - 1; i <= x + 2; i++) {
+        tile = noctt_world_get_tile(world, i, j);
+        assert(tile);
+        assert(tile->x == i && tile->y == j);
+        if (i == x && j == y)
+            ret = check_tile(tile);
+        else
+            check_tile(tile);
+    }
+    return ret;
+}
+
+int main()
+{
+    noctt_world_t *world;
+    uint32_t h1, h2;
+
+    world = noctt_world_create(rule, 5, TILE_SIZE, CACHE_SIZE, 1);
+    noctt_world_set_setup(world, setup, &nb_setups);
+    h1 = show(world, 0, 0);
+    assert(nb_setups == 16);
+    // Not around the view.
+    assert(!noctt_world_get_tile(world, 10, 10));
+
+    // Scroll away: the cache is too small to keep the first tiles.
+    show(world, 100, 0);
+    show(world, 200, 0);
+    assert(nb_setups == 48);
+    // Scroll back: the first tiles are generated again, identically.
+    h2 = show(world, 0, 0);
+    assert(nb_setups == 64);
+    assert(h1 == h2);
+    noctt_world_delete(world);
+
+    // An other world with the same seed gives the same tiles.
+    world = noctt_world_create(rule, 5, TILE_SIZE, CACHE_SIZE, 1);
+    noctt_world_set_setup(world, setup, &nb_setups);
+    assert(show(world, 0, 0) == h1);
+    noctt_world_delete(world);
+
+    printf("All tests passed\n");
+    return 0;
+}